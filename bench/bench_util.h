@@ -0,0 +1,91 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace bench {
+
+using Function = long (*)(long);
+
+constexpr size_t kFunctionSize = 32;
+constexpr uint32_t kAddiA0A0One = 0x00150513;  // addi a0, a0, 1
+constexpr uint32_t kNop = 0x00000013;          // addi zero, zero, 0
+constexpr uint32_t kRet = 0x00008067;          // jalr zero, ra, 0
+
+// Synthetic `long f(long x) { return x + 1; }` functions, each padded to kFunctionSize
+class FunctionPool {
+ public:
+  explicit FunctionPool(size_t count) : count_(count) {
+    auto page_size = static_cast<size_t>(getpagesize());
+    size_ = (count * kFunctionSize + page_size - 1) / page_size * page_size;
+    auto base = mmap(nullptr,
+                     size_,
+                     PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+    if (base == MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+    base_ = static_cast<uint32_t*>(base);
+
+    for (size_t i = 0; i < count; ++i) {
+      auto code = base_ + i * (kFunctionSize / sizeof(uint32_t));
+      code[0] = kAddiA0A0One;
+      for (size_t j = 1; j < kFunctionSize / sizeof(uint32_t) - 1; ++j) {
+        code[j] = kNop;
+      }
+      code[kFunctionSize / sizeof(uint32_t) - 1] = kRet;
+    }
+    __builtin___clear_cache(reinterpret_cast<char*>(base_),
+                            reinterpret_cast<char*>(base_) + count * kFunctionSize);
+  }
+
+  ~FunctionPool() {
+    munmap(base_, size_);
+  }
+
+  [[nodiscard]] Function Get(size_t index) const {
+    return reinterpret_cast<Function>(base_ + index * (kFunctionSize / sizeof(uint32_t)));
+  }
+
+  [[nodiscard]] size_t Size() const {
+    return count_;
+  }
+
+ private:
+  uint32_t* base_;
+  size_t size_;
+  size_t count_;
+};
+
+inline size_t ParseArg(int argc, char** argv, int index, size_t fallback) {
+  if (argc <= index) return fallback;
+  auto value = strtoul(argv[index], nullptr, 0);
+  return value ? value : fallback;
+}
+
+}  // namespace bench
@@ -0,0 +1,162 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures hook/unhook throughput as the number of threads grows.
+//
+// disjoint: every thread hooks its own set of functions, so threads only meet on the
+//           allocator lock and on shards that happen to collide.
+// shared:   every thread hooks the same functions, so all of them chain on one HookInfo.
+//
+// usage: rv64hook-bench-contention [max_threads] [functions_per_thread] [iterations]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bench_util.h"
+#include "rv64hook.h"
+
+namespace {
+
+using bench::FunctionPool;
+
+long Replacement(long x) {
+  return x + 2;
+}
+
+struct Result {
+  size_t operations;
+  size_t failures;
+  double seconds;
+  // Error of the first failed hook, the error buffer is per thread so workers copy it out
+  std::string error;
+};
+
+Result Run(const FunctionPool& pool,
+           size_t threads,
+           size_t functions_per_thread,
+           size_t iterations,
+           bool shared) {
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> go{false};
+  std::atomic<size_t> failures{0};
+  std::mutex error_mutex;
+  std::string error;
+  std::vector<std::thread> workers;
+
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      auto first = shared ? 0 : t * functions_per_thread;
+      std::vector<rv64hook::HookHandle*> handles(functions_per_thread);
+      size_t failed = 0;
+
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+
+      for (size_t i = 0; i < iterations; ++i) {
+        for (size_t f = 0; f < functions_per_thread; ++f) {
+          handles[f] = rv64hook::InlineHook(pool.Get(first + f), Replacement);
+          if (!handles[f] && !failed++) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (error.empty()) error = rv64hook::GetLastError();
+          }
+        }
+        for (auto handle : handles) {
+          if (handle) handle->Unhook();
+        }
+      }
+      failures.fetch_add(failed);
+    });
+  }
+
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return {threads * functions_per_thread * iterations * 2,
+          failures.load(),
+          std::chrono::duration<double>(end - start).count(),
+          std::move(error)};
+}
+
+bool Verify(const FunctionPool& pool) {
+  for (size_t i = 0; i < pool.Size(); ++i) {
+    if (rv64hook::IsHooked(pool.Get(i)) || pool.Get(i)(41) != 42) {
+      fprintf(stderr, "function %zu was not restored\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  auto max_threads =
+      bench::ParseArg(argc, argv, 1, std::max(1U, std::thread::hardware_concurrency()));
+  auto functions_per_thread = bench::ParseArg(argc, argv, 2, 64);
+  auto iterations = bench::ParseArg(argc, argv, 3, 200);
+
+  FunctionPool pool(max_threads * functions_per_thread);
+
+  // Warm up the allocator so the first row does not pay for heap creation
+  Run(pool, 1, functions_per_thread, 1, false);
+
+  for (auto shared : {false, true}) {
+    printf("%s: %zu functions per thread, %zu iterations\n",
+           shared ? "shared" : "disjoint",
+           functions_per_thread,
+           iterations);
+    printf("%8s %12s %10s %14s %8s\n", "threads", "ops", "seconds", "ops/s", "scaling");
+
+    double baseline = 0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      auto result = Run(pool, threads, functions_per_thread, iterations, shared);
+      auto throughput = static_cast<double>(result.operations) / result.seconds;
+      if (threads == 1) baseline = throughput;
+      printf("%8zu %12zu %10.3f %14.0f %7.2fx\n",
+             threads,
+             result.operations,
+             result.seconds,
+             throughput,
+             throughput / baseline);
+      if (result.failures) {
+        fprintf(stderr, "%zu hooks failed: %s\n", result.failures, result.error.c_str());
+        return 1;
+      }
+      if (!Verify(pool)) return 1;
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures how long it takes to install and remove N hooks on fresh functions, and where the
+// time goes. Phase timings need the library built with RV64HOOK_ENABLE_PROFILING, which is the
+// default when RV64HOOK_BUILD_BENCH is on. The batch column installs the same hooks with one
+// HookBatch commit, which relocates in parallel once there are enough of them.
+//
+// usage: rv64hook-bench-install [max_hooks]
+
+#include <malloc.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "bench_util.h"
+#include "rv64hook.h"
+
+namespace {
+
+using bench::FunctionPool;
+using rv64hook::InstallStatistics;
+
+constexpr const char* kPhaseNames[InstallStatistics::kPhaseCount] = {
+    "read",
+    "alloc",
+    "relocate",
+    "info",
+    "write",
+    "flush",
+};
+
+long Replacement(long x) {
+  return x + 2;
+}
+
+size_t GetMallocUsage() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().uordblks;
+#else
+  return static_cast<size_t>(mallinfo().uordblks);
+#endif
+}
+
+double Microseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+bool Run(const FunctionPool& pool, size_t count) {
+  std::vector<rv64hook::HookHandle*> handles(count);
+  InstallStatistics before{}, after{};
+
+  rv64hook::ResetInstallStatistics();
+  rv64hook::GetInstallStatistics(&before);
+  auto malloc_before = GetMallocUsage();
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = rv64hook::InlineHook(pool.Get(i), Replacement);
+    if (!handles[i]) [[unlikely]] {
+      fprintf(stderr, "hook %zu failed: %s\n", i, rv64hook::GetLastError());
+      for (size_t j = 0; j < i; ++j) {
+        handles[j]->Unhook();
+      }
+      return false;
+    }
+  }
+  auto installed = std::chrono::steady_clock::now();
+
+  auto profiled = rv64hook::GetInstallStatistics(&after);
+  auto malloc_after = GetMallocUsage();
+
+  for (size_t i = 0; i < count; ++i) {
+    if (pool.Get(i)(40) != 42) [[unlikely]] {
+      fprintf(stderr, "hook %zu is not active\n", i);
+      return false;
+    }
+  }
+
+  auto unhook_start = std::chrono::steady_clock::now();
+  for (auto handle : handles) {
+    handle->Unhook();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < count; ++i) {
+    if (pool.Get(i)(41) != 42) [[unlikely]] {
+      fprintf(stderr, "hook %zu was not removed\n", i);
+      return false;
+    }
+  }
+
+  rv64hook::HookBatch batch;
+  for (size_t i = 0; i < count; ++i) {
+    batch.InlineHook(pool.Get(i), Replacement);
+  }
+  auto batch_start = std::chrono::steady_clock::now();
+  if (!batch.Commit(handles.data())) [[unlikely]] {
+    fprintf(stderr, "batch failed: %s\n", rv64hook::GetLastError());
+    return false;
+  }
+  auto batch_end = std::chrono::steady_clock::now();
+  for (auto handle : handles) {
+    handle->Unhook();
+  }
+
+  auto n = static_cast<double>(count);
+  printf("%8zu %10.2f %10.2f %10.2f", count, Microseconds(installed - start) / n,
+         Microseconds(batch_end - batch_start) / n, Microseconds(end - unhook_start) / n);
+  for (int phase = 0; phase < InstallStatistics::kPhaseCount; ++phase) {
+    if (profiled) {
+      printf(" %9.2f", static_cast<double>(after.phase_ns[phase]) / 1000 / n);
+    } else {
+      printf(" %9s", "-");
+    }
+  }
+  printf(" %10.0f %10.0f\n",
+         static_cast<double>(after.heap_allocated - before.heap_allocated) / n,
+         static_cast<double>(malloc_after - malloc_before) / n);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  auto max_hooks = bench::ParseArg(argc, argv, 1, 100000);
+
+  FunctionPool pool(max_hooks);
+
+  // Warm up the allocator so the first row does not pay for heap creation
+  if (auto handle = rv64hook::InlineHook(pool.Get(0), Replacement); handle) {
+    handle->Unhook();
+  } else {
+    fprintf(stderr, "hook failed: %s\n", rv64hook::GetLastError());
+    return 1;
+  }
+
+  printf("per hook, in microseconds and bytes\n");
+  printf("%8s %10s %10s %10s", "hooks", "install", "batch", "unhook");
+  for (auto name : kPhaseNames) {
+    printf(" %9s", name);
+  }
+  printf(" %10s %10s\n", "exec", "malloc");
+
+  for (size_t count = 1; count <= max_hooks; count *= 10) {
+    if (!Run(pool, count)) return 1;
+  }
+
+  InstallStatistics stats{};
+  rv64hook::GetInstallStatistics(&stats);
+  printf("\nexecutable heap: %zu bytes reserved, %zu bytes in use\n",
+         stats.heap_mapped,
+         stats.heap_allocated);
+  return 0;
+}
@@ -19,6 +19,7 @@
 #pragma once
 
 #ifdef __cplusplus
+#include <cassert>
 #include <cstdint>
 #include <type_traits>
 #include <version>
@@ -39,8 +40,31 @@ typedef unsigned long reg_t;
 typedef long sreg_t;
 typedef __uint128_t reg128_t;
 
+// Calls of a hooked function timed by its trampoline, see HookHandle::SetCallStatisticsEnabled()
+struct CallStatistics {
+  static constexpr int kHistogramSize = 64;
+
+  // Calls that returned since the last reset
+  uint64_t calls;
+  // Ticks of the time CSR (rdtime) spent in the function
+  uint64_t ticks;
+  // histogram[i] counts calls of [2^i, 2^(i + 1)) ticks, histogram[0] also counts 0
+  uint64_t histogram[kHistogramSize];
+};
+
+// Which calls run the handlers, see HookHandle::SetSampling()
+enum class SamplingMode : uint8_t {
+  // Every Nth call of the function. The countdown is shared by all threads and not atomic, so
+  // concurrent calls may be sampled a little more often
+  kEveryNth = 0,
+  // Each call with a probability of 1 in N, drawn from a per-thread generator
+  kRandom = 1,
+};
+
 class HookHandle {
  public:
+  static constexpr int kReentrancyGroups = 64;
+
   [[nodiscard]] inline func_t GetAddress() const;
 
   [[nodiscard]] inline func_t GetBackup() const;
@@ -49,6 +73,46 @@ class HookHandle {
 
   bool SetEnabledAll(bool enabled);
 
+  // Enables or disables the hooked function on the calling thread only, checked on entry before
+  // anything is saved. Threads that never called it follow SetEnabledByDefault(). Applies to all
+  // handles of the function, on top of SetEnabledAll()
+  bool SetEnabledForCurrentThread(bool enabled);
+
+  // For threads that have not called SetEnabledForCurrentThread(), true unless changed
+  bool SetEnabledByDefault(bool enabled);
+
+  // Swaps the replacement of a hook handle in place, concurrent callers see either the old
+  // or the new one. The old replacement may still be running when this returns
+  bool Retarget(func_t new_hook);
+
+  template <typename Func>
+  inline bool Retarget(Func new_hook);
+
+  // Times every call of the hooked function in its trampoline, from just before the backup is
+  // called to just after it returns. Counters live in per-thread slots and are summed on read.
+  // Applies to all handles of the function
+  bool SetCallStatisticsEnabled(bool enabled);
+
+  // Returns false if statistics were never enabled for the function
+  bool GetCallStatistics(CallStatistics* stats);
+
+  bool ResetCallStatistics();
+
+  // Runs the handlers of the hooked function on 1 in `rate` calls only, the others go straight
+  // to the backup before any register is saved and are not timed either. A rate of 0 or 1 runs
+  // them on every call. Changing only the rate takes effect at once without regenerating code.
+  // Applies to all handles of the function
+  bool SetSampling(uint32_t rate, SamplingMode mode = SamplingMode::kEveryNth);
+
+  // Runs the handlers of the hooked function with a per-thread flag of `group` set. Calls of any
+  // function guarded by the same group made meanwhile on that thread, such as malloc() called
+  // from a handler of malloc(), go straight to the backup before any register is saved. Group 0
+  // is shared by default, other groups below kReentrancyGroups keep sets of hooks apart. Applies
+  // to all handles of the function
+  bool SetReentrancyGuard(bool enabled, uint8_t group = 0);
+
+  // Fails and leaves the handle hooked if the trampoline for the remaining handles cannot be
+  // generated
   bool Unhook();
 
   bool UnhookAll();
@@ -58,6 +122,19 @@ class HookHandle {
   func_t backup_;
 };
 
+class DeferredHook {
+ public:
+  // nullptr until the library is loaded, and again after it has been unloaded.
+  // Do not unhook the returned handle directly, use Cancel()
+  [[nodiscard]] inline HookHandle* GetHandle() const;
+
+  // Unhooks if applied, then forgets the registration, `this` is invalid afterwards
+  bool Cancel();
+
+ protected:
+  HookHandle* handle_;
+};
+
 union freg_t {
   float f;
   double d;
@@ -98,6 +175,21 @@ union freg_t {
 #endif
 };
 
+// Registers a handler may use. The trampoline only saves and restores what the level covers,
+// the rest of the context is undefined and writes to it are lost
+enum class ContextLevel : uint8_t {
+  kFull = 0,
+  // ra, sp, a0-a7 and fa0-fa7. Not for functions that take anything else on entry, such as
+  // a static chain in t2
+  kArguments = 1,
+  // ra, sp and a0-a7. fa0-fa7 are still preserved around the handlers, they just cannot be
+  // read or written through the context
+  kIntegerArguments = 2,
+  // kFull, plus v0-v31, vl and vtype in a VLEN-sized area on the stack of the calling thread.
+  // Needs a library built with the vector extension
+  kVector = 3,
+};
+
 class RegisterContext {
  public:
 #ifdef __aarch64__
@@ -168,8 +260,37 @@ class RegisterContext {
   template <uint16_t N, typename T>
   inline void SetArg(T value);
 
+  [[nodiscard]] inline ContextLevel GetContextLevel() const;
+
+#ifndef __aarch64__
+  // The vector accessors need ContextLevel::kVector. Registers are VLENB bytes each and are
+  // written back, together with vl and vtype, when the handler returns
+  template <typename T = uint8_t>
+  [[nodiscard]] inline T* GetVectorRegister(uint8_t n);
+
+  template <typename T = uint8_t>
+  [[nodiscard]] inline const T* GetVectorRegister(uint8_t n) const;
+
+  [[nodiscard]] inline size_t GetVectorRegisterSize() const;
+
+  [[nodiscard]] inline reg_t GetVectorLength() const;
+
+  [[nodiscard]] inline reg_t GetVectorType() const;
+
+  // The trampoline restores them with vsetvl, so vl is clamped to VLMAX of `vtype`
+  inline void SetVectorConfig(reg_t vl, reg_t vtype);
+#endif
+
  private:
   [[maybe_unused]] bool return_early_;
+  [[maybe_unused]] ContextLevel level_;
+#ifndef __aarch64__
+  // vl, vtype, vlenb and a padding slot, then v0-v31
+  [[maybe_unused]] reg_t* vector_;
+#endif
+
+  template <typename T>
+  inline void check_level() const;
 
   template <typename T, typename V>
   static constexpr inline T force_cast(V value);
@@ -183,6 +304,9 @@ class RegisterContext {
 
 typedef void (*RegisterHandler)(RegisterContext* ctx, HookHandle* handle, void* data);
 
+// `site` is the probed function and `ra` the return address of its caller
+typedef void (*ProbeHandler)(void* site, reg_t ra, void* data);
+
 enum class TrampolineType {
   kCustom = 0,
 #ifdef __aarch64__
@@ -221,6 +345,35 @@ class TrampolineAllocator {
                              void* data = nullptr);
 };
 
+struct InstallStatistics {
+  enum Phase {
+    kReadTest,
+    kAllocSecondTrampoline,
+    kRelocate,
+    kCreateInfo,
+    kWriteFirstTrampoline,
+    kFlushICache,
+    kPhaseCount,
+  };
+
+  // Accumulated nanoseconds per phase, only recorded when built with RV64HOOK_ENABLE_PROFILING
+  uint64_t phase_ns[kPhaseCount];
+  // Functions that have been patched since the last reset
+  uint64_t installs;
+  // Lookups in the relocation cache since the last reset, see SetRelocationCache()
+  uint64_t relocation_cache_hits;
+  uint64_t relocation_cache_misses;
+  // Cross-hart instruction cache synchronizations, and the patched ranges they covered
+  uint64_t icache_syncs;
+  uint64_t icache_ranges;
+  // Functions currently hooked
+  size_t hooked_functions;
+  // Executable memory reserved by the trampoline allocator
+  size_t heap_mapped;
+  // Executable memory handed out for trampolines and relocated code
+  size_t heap_allocated;
+};
+
 // ========================= Functions =========================
 
 HookHandle* InlineHook(func_t address, func_t hook, func_t* backup = nullptr);
@@ -233,14 +386,89 @@ HookHandle* InlineInstrument(func_t address,
                              void* data = nullptr,
                              func_t* backup = nullptr);
 
+// Handlers of one function share a trampoline, which saves what the most demanding of them needs
+HookHandle* InlineInstrument(func_t address,
+                             RegisterHandler pre_handler,
+                             RegisterHandler post_handler,
+                             void* data,
+                             func_t* backup,
+                             ContextLevel context);
+
+// Calls `probe` on every entry of the function and then continues in it. Only the argument
+// registers and ra are saved around the call, so there is no RegisterContext and the call
+// cannot be skipped. Shares the trampoline with other hooks of the function
+HookHandle* InlineProbe(func_t address, ProbeHandler probe, void* data = nullptr);
+
 int WriteTrampoline(func_t address, func_t hook, func_t* backup = nullptr);
 
 bool InlineUnhook(func_t address);
 
+// Lock-free, safe to call from hot paths and from hooks themselves
+[[nodiscard]] bool IsHooked(func_t address);
+
+// Resolves through .gnu.hash/.hash and falls back to .symtab of the file on disk.
+// `library` is a file name or full path, nullptr searches every loaded module
+[[nodiscard]] func_t FindSymbol(const char* library, const char* symbol);
+
+// Resolves `symbol` with FindSymbol and makes the function writable while hooking it
+HookHandle* InlineHook(const char* library,
+                       const char* symbol,
+                       func_t hook,
+                       func_t* backup = nullptr);
+
+HookHandle* InlineInstrument(const char* library,
+                             const char* symbol,
+                             RegisterHandler pre_handler,
+                             RegisterHandler post_handler,
+                             void* data = nullptr,
+                             func_t* backup = nullptr);
+
+HookHandle* InlineInstrument(const char* library,
+                             const char* symbol,
+                             RegisterHandler pre_handler,
+                             RegisterHandler post_handler,
+                             void* data,
+                             func_t* backup,
+                             ContextLevel context);
+
+// Hooks `symbol` in `library` (file name or full path) as soon as the library is loaded,
+// and forgets the hook once it is unloaded. With glibc this may happen on a thread of the
+// library's own shortly after dlopen returns, once the loader lock is free. From the first
+// deferred hook on, every hook into a library that gets unloaded is dropped as well, and its
+// handles become invalid
+DeferredHook* InlineHookDeferred(const char* library,
+                                 const char* symbol,
+                                 func_t hook,
+                                 func_t* backup = nullptr);
+
+DeferredHook* InlineInstrumentDeferred(const char* library,
+                                       const char* symbol,
+                                       RegisterHandler pre_handler,
+                                       RegisterHandler post_handler,
+                                       void* data = nullptr,
+                                       func_t* backup = nullptr);
+
+DeferredHook* InlineInstrumentDeferred(const char* library,
+                                       const char* symbol,
+                                       RegisterHandler pre_handler,
+                                       RegisterHandler post_handler,
+                                       void* data,
+                                       func_t* backup,
+                                       ContextLevel context);
+
 bool SetTrampolineAllocator(TrampolineAllocator allocator);
 
+// Persists relocated function prologues in `path` so later runs can skip decoding them.
+// Only functions in modules with a build-id are cached, nullptr disables the cache
+bool SetRelocationCache(const char* path);
+
 [[nodiscard]] const char* GetLastError();
 
+// Returns false if phase timings are not available in this build
+bool GetInstallStatistics(InstallStatistics* stats);
+
+void ResetInstallStatistics();
+
 // ========================= Templates =========================
 
 template <typename Func, typename MayLambda = Func>
@@ -254,6 +482,7 @@ template <typename Data>
 struct InstrumentCallbacks {
   void (*pre)(RegisterContext* ctx, HookHandle* handle, Data* data);
   void (*post)(RegisterContext* ctx, HookHandle* handle, Data* data);
+  ContextLevel context = ContextLevel::kFull;
 };
 
 template <typename Data, typename Func>
@@ -265,7 +494,74 @@ static inline auto InlineInstrument(Func address,
                           reinterpret_cast<RegisterHandler>(callbacks.pre),
                           reinterpret_cast<RegisterHandler>(callbacks.post),
                           static_cast<void*>(data),
-                          reinterpret_cast<func_t*>(backup));
+                          reinterpret_cast<func_t*>(backup),
+                          callbacks.context);
+}
+
+// Compiled wrapper around `kTarget` for InstrumentTyped(). It is installed as a replacement, so
+// the trampoline saves nothing and the handlers get the arguments as the compiler passes them
+template <auto kTarget>
+class TypedThunk;
+
+template <typename R, typename... A>
+struct TypedPost {
+  using Type = void (*)(R& result, A... args);
+};
+
+template <typename... A>
+struct TypedPost<void, A...> {
+  using Type = void (*)(A... args);
+};
+
+template <typename R, typename... A, R (*kTarget)(A...)>
+class TypedThunk<kTarget> {
+ public:
+  // May change the arguments before the target sees them
+  using Pre = void (*)(A&... args);
+  // May change the result
+  using Post = typename TypedPost<R, A...>::Type;
+
+  static inline R (*backup)(A...) = nullptr;
+  static inline Pre pre = nullptr;
+  static inline Post post = nullptr;
+  static inline HookHandle* handle = nullptr;
+
+  static R Call(A... args) {
+    if (auto p = __atomic_load_n(&pre, __ATOMIC_RELAXED)) p(args...);
+    if constexpr (std::is_void_v<R>) {
+      backup(args...);
+      if (auto p = __atomic_load_n(&post, __ATOMIC_RELAXED)) p(args...);
+    } else {
+      R result = backup(args...);
+      if (auto p = __atomic_load_n(&post, __ATOMIC_RELAXED)) p(result, args...);
+      return result;
+    }
+  }
+};
+
+// Typed alternative to InlineInstrument() for a function known at compile time, the handlers
+// take its real parameter types. One instrumentation per target: calling it again while one is
+// installed only swaps the handlers. Not thread-safe for the same target
+template <auto kTarget>
+static inline HookHandle* InstrumentTyped(typename TypedThunk<kTarget>::Pre pre,
+                                          typename TypedThunk<kTarget>::Post post = nullptr) {
+  using Thunk = TypedThunk<kTarget>;
+  __atomic_store_n(&Thunk::pre, pre, __ATOMIC_RELAXED);
+  __atomic_store_n(&Thunk::post, post, __ATOMIC_RELAXED);
+  if (!Thunk::handle) {
+    Thunk::handle = InlineHook(reinterpret_cast<func_t>(kTarget),
+                               reinterpret_cast<func_t>(&Thunk::Call),
+                               reinterpret_cast<func_t*>(&Thunk::backup));
+  }
+  return Thunk::handle;
+}
+
+template <auto kTarget>
+static inline bool UninstrumentTyped() {
+  using Thunk = TypedThunk<kTarget>;
+  if (!Thunk::handle || !Thunk::handle->Unhook()) return false;
+  Thunk::handle = nullptr;
+  return true;
 }
 
 template <typename Func, typename MayLambda = Func>
@@ -275,6 +571,47 @@ static inline auto WriteTrampoline(Func address, MayLambda hook, Func* backup =
                          reinterpret_cast<func_t*>(backup));
 }
 
+template <typename Func, typename MayLambda = Func>
+static inline auto InlineHook(const char* library,
+                              const char* symbol,
+                              MayLambda hook,
+                              Func* backup) {
+  return InlineHook(library,
+                    symbol,
+                    reinterpret_cast<func_t>(static_cast<Func>(hook)),
+                    reinterpret_cast<func_t*>(backup));
+}
+
+template <typename Func, typename MayLambda = Func>
+static inline auto InlineHookDeferred(const char* library,
+                                      const char* symbol,
+                                      MayLambda hook,
+                                      Func* backup) {
+  return InlineHookDeferred(library,
+                            symbol,
+                            reinterpret_cast<func_t>(static_cast<Func>(hook)),
+                            reinterpret_cast<func_t*>(backup));
+}
+
+template <typename Data>
+static inline auto InlineInstrumentDeferred(const char* library,
+                                            const char* symbol,
+                                            InstrumentCallbacks<Data> callbacks,
+                                            Data* data = static_cast<void*>(nullptr)) {
+  return InlineInstrumentDeferred(library,
+                                  symbol,
+                                  reinterpret_cast<RegisterHandler>(callbacks.pre),
+                                  reinterpret_cast<RegisterHandler>(callbacks.post),
+                                  static_cast<void*>(data),
+                                  nullptr,
+                                  callbacks.context);
+}
+
+template <typename Func>
+[[nodiscard]] static inline bool IsHooked(Func address) {
+  return IsHooked(reinterpret_cast<func_t>(address));
+}
+
 // ========================= Helpers =========================
 
 class ScopedRWXMemory {
@@ -298,6 +635,51 @@ class ScopedRWXMemory {
   int prot_;
 };
 
+class HookBatch {
+ public:
+  explicit HookBatch(int original_prot = ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+
+  HookBatch(const HookBatch&) = delete;
+
+  HookBatch& operator=(const HookBatch&) = delete;
+
+  ~HookBatch();
+
+  bool InlineHook(func_t address, func_t hook, func_t* backup = nullptr);
+
+  bool InlineInstrument(func_t address,
+                        RegisterHandler pre_handler,
+                        RegisterHandler post_handler,
+                        void* data = nullptr,
+                        func_t* backup = nullptr);
+
+  bool InlineInstrument(func_t address,
+                        RegisterHandler pre_handler,
+                        RegisterHandler post_handler,
+                        void* data,
+                        func_t* backup,
+                        ContextLevel context);
+
+  template <typename Func, typename MayLambda = Func>
+  inline bool InlineHook(Func address, MayLambda hook, Func* backup = nullptr);
+
+  template <typename Data, typename Func>
+  inline bool InlineInstrument(Func address,
+                               InstrumentCallbacks<Data> callbacks,
+                               Data* data = static_cast<void*>(nullptr),
+                               Func* backup = nullptr);
+
+  [[nodiscard]] size_t Size() const;
+
+  bool Commit(HookHandle** handles = nullptr);
+
+  void Clear();
+
+ private:
+  void* requests_;
+  int prot_;
+};
+
 class Args {
  public:
   inline Args(RegisterContext* ctx);
@@ -351,6 +733,15 @@ inline func_t HookHandle::GetBackup() const {
   return backup_;
 }
 
+template <typename Func>
+inline bool HookHandle::Retarget(Func new_hook) {
+  return Retarget(reinterpret_cast<func_t>(new_hook));
+}
+
+inline HookHandle* DeferredHook::GetHandle() const {
+  return handle_;
+}
+
 constexpr inline freg_t::operator float() const {
   return f;
 }
@@ -448,6 +839,53 @@ inline bool RegisterContext::IsReturned() const {
   return return_early_;
 }
 
+inline ContextLevel RegisterContext::GetContextLevel() const {
+  return level_;
+}
+
+#ifndef __aarch64__
+template <typename T>
+inline T* RegisterContext::GetVectorRegister(uint8_t n) {
+  assert(level_ == ContextLevel::kVector && n < 32);
+  return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(vector_ + 4) + n * vector_[2]);
+}
+
+template <typename T>
+inline const T* RegisterContext::GetVectorRegister(uint8_t n) const {
+  assert(level_ == ContextLevel::kVector && n < 32);
+  return reinterpret_cast<const T*>(reinterpret_cast<const uint8_t*>(vector_ + 4) +
+                                    n * vector_[2]);
+}
+
+inline size_t RegisterContext::GetVectorRegisterSize() const {
+  assert(level_ == ContextLevel::kVector);
+  return vector_[2];
+}
+
+inline reg_t RegisterContext::GetVectorLength() const {
+  assert(level_ == ContextLevel::kVector);
+  return vector_[0];
+}
+
+inline reg_t RegisterContext::GetVectorType() const {
+  assert(level_ == ContextLevel::kVector);
+  return vector_[1];
+}
+
+inline void RegisterContext::SetVectorConfig(reg_t vl, reg_t vtype) {
+  assert(level_ == ContextLevel::kVector);
+  vector_[0] = vl;
+  vector_[1] = vtype;
+}
+#endif
+
+template <typename T>
+inline void RegisterContext::check_level() const {
+  if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+    assert(level_ != ContextLevel::kIntegerArguments && "Floating point registers are not saved");
+  }
+}
+
 #ifdef __aarch64__
 template <uint16_t N, typename T>
 inline T RegisterContext::GetArg() const {
@@ -488,6 +926,7 @@ inline T RegisterContext::GetArg() const {
   static_assert(sizeof(T) <= sizeof(reg_t), "Invalid type");
   static_assert(N <= 7 || !(std::is_same_v<T, float> || std::is_same_v<T, double>),
                 "Unsupported argument index");
+  if constexpr (N <= 7) check_level<T>();
 
   if constexpr (N == 0) return get_reg<T>(a0, fa0);
   else if constexpr (N == 1) return get_reg<T>(a1, fa1);
@@ -505,6 +944,7 @@ inline void RegisterContext::SetArg(T value) {
   static_assert(sizeof(T) <= sizeof(reg_t), "Invalid type");
   static_assert(N <= 7 || !(std::is_same_v<T, float> || std::is_same_v<T, double>),
                 "Unsupported argument index");
+  if constexpr (N <= 7) check_level<T>();
 
   if constexpr (N == 0) set_reg(a0, fa0, value);
   else if constexpr (N == 1) set_reg(a1, fa1, value);
@@ -557,6 +997,26 @@ inline bool ScopedRWXMemory::IsValid() {
   return address_ != nullptr;
 }
 
+template <typename Func, typename MayLambda>
+inline bool HookBatch::InlineHook(Func address, MayLambda hook, Func* backup) {
+  return InlineHook(reinterpret_cast<func_t>(address),
+                    reinterpret_cast<func_t>(static_cast<Func>(hook)),
+                    reinterpret_cast<func_t*>(backup));
+}
+
+template <typename Data, typename Func>
+inline bool HookBatch::InlineInstrument(Func address,
+                                        InstrumentCallbacks<Data> callbacks,
+                                        Data* data,
+                                        Func* backup) {
+  return InlineInstrument(reinterpret_cast<func_t>(address),
+                          reinterpret_cast<RegisterHandler>(callbacks.pre),
+                          reinterpret_cast<RegisterHandler>(callbacks.post),
+                          static_cast<void*>(data),
+                          reinterpret_cast<func_t*>(backup),
+                          callbacks.context);
+}
+
 #ifdef __riscv
 inline Args::Args(RegisterContext* ctx) : ctx_(ctx), sp_(ctx->sp), x_(0), f_(0) {
 }
@@ -616,6 +1076,8 @@ inline T* Args::next() const {
       return reinterpret_cast<T*>(sp);
     }
   } else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+    assert(ctx_->GetContextLevel() != ContextLevel::kIntegerArguments &&
+           "Floating point registers are not saved");
     if (f_ <= 7) [[likely]] {
       auto f = kConst ? f_ : f_++;
       return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(ctx_) +
@@ -742,12 +1204,16 @@ bool RV64_SetEnabled(RV64_HookHandle* handle, bool enabled) __asm__("_ZN8rv64hoo
 
 bool RV64_SetEnabledAll(RV64_HookHandle* handle, bool enabled) __asm__("_ZN8rv64hook10HookHandle13SetEnabledAllEb");
 
+bool RV64_Retarget(RV64_HookHandle* handle, void* new_hook) __asm__("_ZN8rv64hook10HookHandle8RetargetEPv");
+
 void RV64_Unhook(RV64_HookHandle* handle) __asm__("_ZN8rv64hook10HookHandle6UnhookEv");
 
 void RV64_UnhookAll(RV64_HookHandle* handle) __asm__("_ZN8rv64hook10HookHandle9UnhookAllEv");
 
 bool RV64_InlineUnhook(void* address) __asm__("_ZN8rv64hook12InlineUnhookEPv");
 
+bool RV64_IsHooked(void* address) __asm__("_ZN8rv64hook8IsHookedEPv");
+
 const char* RV64_GetLastError() __asm__("_ZN8rv64hook12GetLastErrorEv");
 // clang-format on
 
@@ -19,10 +19,31 @@
 #ifndef __RV64HOOK_ARCH_COMMON_HANDLE_OFFSET_H__
 #define __RV64HOOK_ARCH_COMMON_HANDLE_OFFSET_H__
 
-#define HookHandle_next         (8 * 4)
-#define HookHandle_pre_handler  (8 * 6)
-#define HookHandle_post_handler (8 * 7)
-#define HookHandle_data         (8 * 8)
-#define HookHandle_enabled      (8 * 10)
+// TrampolineData, for the shared generic trampoline
+#define TrampolineData_handlers      0
+#define TrampolineData_hook          8
+#define TrampolineData_backup        16
+#define TrampolineData_post_handlers 24
+#define TrampolineData_enabled       26
+#define TrampolineData_dispatcher    32
+
+// Where the per-hook stub returns into the generic trampoline, and how far its return entry
+// is from the TrampolineData that follows it
+#define Dispatcher_return   32
+#define Stub_return_to_data 16
+
+// In front of the generic trampoline: ShadowStack, or nullptr to keep the return address in a
+// temporary register
+#define Dispatcher_pop_return_address  -16
+#define Dispatcher_push_return_address -8
+
+// HandlerTable, for the callrh loop of the generic trampolines
+#define HandlerTable_count        0
+#define HandlerTable_entries      64
+#define HandlerEntry_shift        5
+#define HandlerEntry_handle       0
+#define HandlerEntry_pre_handler  8
+#define HandlerEntry_post_handler 16
+#define HandlerEntry_data         24
 
 #endif
@@ -15,16 +15,49 @@
  * License along with riscv64-inline-hook.
  * If not, see <https://www.gnu.org/licenses/>.
  */
-
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 namespace rv64hook {
 
+// Relocated instructions in a private buffer, not executable until installed. Fixed-size, so
+// preparing the relocation never touches the heap
+struct RelocatedCode {
+  // Well above what relocating the largest first trampoline can produce
+  static constexpr size_t kMaxCodeSize = 384;
+  static constexpr size_t kMaxLiterals = 16;
+
+  // A pc-relative load of a literal, which Install may turn into immediates once the code has
+  // its final address
+  struct Load {
+    uint16_t position;
+    // Followed by a jump through the loaded register, which a direct jump can replace
+    bool jump;
+  };
+
+  uint8_t code[kMaxCodeSize];
+  uint16_t code_size;
+  // Offsets of the 64-bit absolute addresses in code, everything else is position independent
+  uint16_t literals[kMaxLiterals];
+  uint8_t literal_count;
+  Load loads[kMaxLiterals];
+  uint8_t load_count;
+  size_t overwrite_size;
+  // Where the code was relocated from, Install tries to place it within reach
+  uintptr_t address;
+};
+
 class InstructionRelocator {
  public:
   static size_t Relocate(const void* address, int size, void** relocated);
+
+  // Thread-safe, does not allocate from the executable heap
+  static bool Prepare(const void* address, int size, RelocatedCode* relocated);
+
+  // Allocates when no slab or chunk in reach has room, see Memory::Alloc
+  static void* Install(const RelocatedCode& relocated);
 };
 
 }  // namespace rv64hook
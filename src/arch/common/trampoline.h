@@ -18,11 +18,16 @@
 
 #pragma once
 
-#include <pthread.h>
-
+#include <cstddef>
 #include <tuple>
+#include <vector>
 
+#include "arch/common/handle_offset.h"
+#include "core/handler_table.h"
+#include "core/reentrancy_guard.h"
 #include "core/rv64hook_internal.h"
+#include "core/sampler.h"
+#include "core/thread_filter.h"
 
 namespace rv64hook {
 
@@ -32,20 +37,66 @@ static constexpr uint8_t kMaxFirstTrampolineSize = 28;
 static constexpr uint8_t kMaxFirstTrampolineSize = 48;
 #endif
 
-class HookHandleExt;
-
 struct TrampolineData {
-  [[maybe_unused]] HookHandleExt* root_handle;
+  // Replaced when it grows, the generic code reloads it for every entry
+  [[maybe_unused]] HandlerTable* handlers;
   [[maybe_unused]] void* hook;
   [[maybe_unused]] void* backup;
-  [[maybe_unused]] void* (*getspecific)(pthread_key_t);
-  [[maybe_unused]] int (*setspecific)(pthread_key_t, const void*);
-  [[maybe_unused]] pthread_key_t tls_key;
   [[maybe_unused]] uint16_t post_handlers;
   [[maybe_unused]] bool enabled;
+  // The generic code shared by every hook, which the stub in front of this data jumps to.
+  // What every hook shares, such as the ShadowStack functions, is kept in front of the code
+  [[maybe_unused]] void* dispatcher;
 };
 
-static_assert(sizeof(pthread_key_t) == sizeof(int), "Bad pthread_key_t");
+static_assert(offsetof(TrampolineData, handlers) == TrampolineData_handlers, "Bad offset");
+static_assert(offsetof(TrampolineData, hook) == TrampolineData_hook, "Bad offset");
+static_assert(offsetof(TrampolineData, backup) == TrampolineData_backup, "Bad offset");
+static_assert(offsetof(TrampolineData, post_handlers) == TrampolineData_post_handlers,
+              "Bad offset");
+static_assert(offsetof(TrampolineData, enabled) == TrampolineData_enabled, "Bad offset");
+static_assert(offsetof(TrampolineData, dispatcher) == TrampolineData_dispatcher, "Bad offset");
+
+// A handler called directly by generated code, with its handle and data as immediates
+struct HandlerCall {
+  RegisterHandler handler;
+  HookHandle* handle;
+  void* data;
+  // Called instead of `handler` when set, see InlineProbe()
+  ProbeHandler probe;
+
+  bool operator==(const HandlerCall&) const = default;
+};
+
+// What a specialized second trampoline dispatches, derived from the handle list
+struct TrampolineShape {
+  bool replace;
+  // The enabled handlers in list order, so enabling or disabling a handle changes the shape
+  std::vector<HandlerCall> pre_handlers;
+  std::vector<HandlerCall> post_handlers;
+  // Registers saved around the handlers
+  ContextLevel context;
+  // CallRecorder slot the calls are timed into, or CallRecorder::kNoSlot
+  int32_t stats_slot;
+  // ThreadFilter index checked before anything else, or ThreadFilter::kNone
+  int16_t thread_filter;
+  bool enabled_by_default;
+  // Whether calls are sampled before anything else, and how
+  bool sampled;
+  SamplingMode sampling;
+  // Owned by the HookInfo, nullptr unless sampled
+  Sampler::State* sampler;
+  // ReentrancyGuard group the handlers run under, or ReentrancyGuard::kNone
+  int8_t reentrancy_group;
+  // The handlers are read from the HandlerTable at run time, like the generic code does, so
+  // handles can come, go and be toggled without a new shape. The lists are then empty and
+  // these flags say whether there are any
+  bool table_handlers;
+  bool has_pre_handlers;
+  bool has_post_handlers;
+
+  bool operator==(const TrampolineShape&) const = default;
+};
 
 class Trampoline {
  public:
@@ -55,17 +106,34 @@ class Trampoline {
 
   static int GetFirstTrampolineSize(TrampolineType type);
 
-  static bool WriteFirstTrampoline(func_t address, void* target, TrampolineType type);
+  static bool WriteFirstTrampoline(func_t address,
+                                   void* target,
+                                   TrampolineType type,
+                                   bool flush_cache = true);
 
+  // A small stub followed by the TrampolineData, the generic code itself is shared
   static std::tuple<void*, bool> AllocSecondTrampoline(func_t address);
 
+  // For trampolines that were not made by a custom allocator
+  static void FreeSecondTrampoline(void* trampoline);
+
   static TrampolineData* GetTrampolineData(void* trampoline);
 
+  // Returns nullptr if the code cannot be placed within reach of the trampoline entry
+  static void* GenerateSecondTrampoline(void* trampoline, const TrampolineShape& shape);
+
+  // Routes calls entering the trampoline to `code`, or to the generic code for nullptr.
+  // The trampoline must be writable
+  static void SetSecondTrampolineEntry(void* trampoline, void* code);
+
   [[gnu::always_inline]] static std::tuple<const void*, size_t> GetSecondTrampoline();
 
  private:
   static constexpr const char* kTag = "Trampoline";
 
+  // The generic code, copied once into executable memory behind the data every hook shares
+  static void* GetDispatcher();
+
 #ifdef __riscv
   static bool Write32BitJumpInstruction(uint32_t op, func_t address, uint32_t v);
 #endif
@@ -18,12 +18,16 @@
 
 #pragma once
 
+#include <tuple>
+
 #include "arch/common/instruction_relocator.h"
 #include "berberis/assembler/rv64i.h"
 #include "berberis/decoder/riscv64/decoder.h"
 #include "config.h"
+#include "core/icache.h"
 #include "core/logger.h"
 #include "core/memory.h"
+#include "libc/libc.h"
 
 namespace rv64hook {
 
@@ -38,13 +42,21 @@ class Assembler : public berberis::rv64i::Assembler {
 class RV64Relocator {
  public:
   using Decoder = berberis::Decoder<RV64Relocator>;
-  using Register = Assembler::Register;
 
   static size_t Relocate(const uint16_t* address, int size, void** relocated) {
-    berberis::MachineCode code;
-    Assembler assembler(&code);
+    RelocatedCode code;
+    if (!Prepare(address, size, &code)) [[unlikely]] {
+      return 0;
+    }
+    *relocated = Install(code);
+    return *relocated ? code.overwrite_size : 0;
+  }
 
-    RV64Relocator relocator(assembler);
+  // Only touches thread-private state, so it may run concurrently with other preparations. Emits
+  // straight into `relocated` without allocating, so malloc itself can be hooked meanwhile as long
+  // as the relocation cache is off
+  static bool Prepare(const uint16_t* address, int size, RelocatedCode* relocated) {
+    RV64Relocator relocator(relocated);
     Decoder decoder(&relocator);
 
     size_t overwrite_size = 0;
@@ -52,13 +64,10 @@ class RV64Relocator {
       relocator.SetPC(reinterpret_cast<uintptr_t>(address));
       auto count = decoder.Decode(address);
       if (auto state = relocator.GetState(); state == kSkipped) {
-        if (count == 4) {
-          assembler.TwoByte(address[0], address[1]);
-        } else {
-          assembler.TwoByte(address[0]);
-        }
+        relocator.Emit16(address[0]);
+        if (count == 4) relocator.Emit16(address[1]);
       } else if (state != kRelocated) {
-        return 0;
+        return false;
       }
       size -= count;
       address += count / sizeof(uint16_t);
@@ -66,79 +75,80 @@ class RV64Relocator {
     }
 
     relocator.JumpAddress(reinterpret_cast<uint64_t>(address));
-    relocator.EmitAddresses();
-    assembler.Finalize();
-
-    auto backup = Memory::Alloc(code.install_size());
-    *relocated = backup;
+    // The generated code is position independent, literals are loaded pc-relative
+    if (!relocator.EmitLiterals()) [[unlikely]] {
+      SET_ERROR("Relocated code is too large");
+      return false;
+    }
+    relocated->overwrite_size = overwrite_size;
+    relocated->address = reinterpret_cast<uintptr_t>(address) - overwrite_size;
+    return true;
+  }
+
+  static void* Install(const RelocatedCode& relocated) {
+    auto size = relocated.code_size;
+    // A prologue relocates to a few dozen bytes, so it takes a slot rather than a whole chunk
+    // whenever it fits in one
+    auto alloc = [size](uintptr_t start, uintptr_t end) {
+      auto ptr = Memory::AllocSlot(size, start, end);
+      if (!ptr) ptr = start || end ? Memory::Alloc(size, start, end) : Memory::Alloc(size);
+      return ptr;
+    };
+    // Within reach of auipc, so the literal loads can become immediates
+    auto address = relocated.address;
+    auto start = address > kPCRelativeRange ? address - kPCRelativeRange : 0;
+    auto backup = alloc(start, address + kPCRelativeRange);
+    if (!backup) {
+      backup = alloc(0, 0);
+    }
+    if (!backup) [[unlikely]] {
+      SET_ERROR("Out of memory");
+      return nullptr;
+    }
 
-    berberis::RecoveryMap recovery_map;
     ScopedWritableAllocatedMemory unused(backup);
-    code.InstallUnsafe(static_cast<uint8_t*>(backup), &recovery_map);
-    __builtin___clear_cache(static_cast<char*>(backup),
-                            static_cast<char*>(backup) + code.install_size());
-
-    return overwrite_size;
+    libc_memcpy(backup, relocated.code, size);
+    for (uint8_t i = 0; i < relocated.load_count; ++i) {
+      Materialize(static_cast<uint8_t*>(backup), relocated.loads[i]);
+    }
+    ICache::Invalidate(backup, size);
+    return backup;
   }
 
   void Auipc(const typename Decoder::UpperImmArgs& args) {
-    assembler_.Ld(Register{args.dst}, addresses_[GetPC() + args.imm]);
+    LoadAddress(args.dst, GetPC() + args.imm);
     SetNewState(kRelocated);
   }
 
   void CompareAndBranch(const typename Decoder::BranchArgs& args) {
-    auto address = GetPC() + args.offset;
-    auto& label = *assembler_.MakeLabel();
-    auto& branch_label = *assembler_.MakeLabel();
     switch (args.opcode) {
       case Decoder::BranchOpcode::kBeq:
-        if (args.src2 == 0) {
-          assembler_.Beqz(Register{args.src1}, branch_label);
-        } else {
-          assembler_.Beq(Register{args.src1}, Register{args.src2}, branch_label);
-        }
-        break;
       case Decoder::BranchOpcode::kBne:
-        if (args.src2 == 0) {
-          assembler_.Bnez(Register{args.src1}, branch_label);
-        } else {
-          assembler_.Bne(Register{args.src1}, Register{args.src2}, branch_label);
-        }
-        break;
       case Decoder::BranchOpcode::kBlt:
-        if (args.src2 == 0) {
-          assembler_.Bltz(Register{args.src1}, branch_label);
-        } else {
-          assembler_.Blt(Register{args.src1}, Register{args.src2}, branch_label);
-        }
-        break;
       case Decoder::BranchOpcode::kBge:
-        if (args.src2 == 0) {
-          assembler_.Bgez(Register{args.src1}, branch_label);
-        } else {
-          assembler_.Bge(Register{args.src1}, Register{args.src2}, branch_label);
-        }
-        break;
       case Decoder::BranchOpcode::kBltu:
-        assembler_.Bltu(Register{args.src1}, Register{args.src2}, branch_label);
-        break;
       case Decoder::BranchOpcode::kBgeu:
-        assembler_.Bgeu(Register{args.src1}, Register{args.src2}, branch_label);
         break;
       default:
         Undefined();
         return;
     }
-    assembler_.Jal(Assembler::zero, label);
-    assembler_.Bind(&branch_label);
-    JumpAddress(address);
-    assembler_.Bind(&label);
+    // b<cond> src1, src2, taken
+    // j       not_taken
+    // taken:  jump to the original target
+    // not_taken:
+    Emit32(0x00000063 | (static_cast<uint32_t>(args.opcode) << 12) | (args.src1 << 15) |
+           (args.src2 << 20) | Assembler::BImmediate(8).EncodedValue());
+    auto skip = code_size();
+    Emit32(0);
+    JumpAddress(GetPC() + args.offset);
+    Patch32(skip, EncodeJal(kZero, static_cast<int32_t>(code_size() - skip)));
     SetNewState(kRelocated);
   }
 
   void JumpAndLink(const typename Decoder::JumpAndLinkArgs& args) {
-    assembler_.Ld(Assembler::TMP_GENERIC_REGISTER, addresses_[GetPC() + args.offset]);
-    assembler_.Jalr(Register{args.dst}, Assembler::TMP_GENERIC_REGISTER, 0);
+    LoadAddress(kTmp, GetPC() + args.offset, true);
+    Emit32(EncodeJalr(args.dst, kTmp));
     SetNewState(kRelocated);
   }
 
@@ -270,13 +280,35 @@ class RV64Relocator {
   static constexpr uint8_t kRelocated = 2;
   static constexpr uint8_t kError = 3;
 
-  Assembler& assembler_;
-  std::map<uint64_t, Assembler::Label> addresses_{};
+  static constexpr uint32_t kZero = 0;
+  static constexpr uint32_t kTmp = 28;  // TMP_GENERIC_REGISTER
+  static constexpr uint32_t kNop = 0x00000013;
+  // Conservative for both the allocation and the sign-adjusted auipc + addi pair
+  static constexpr uintptr_t kPCRelativeRange = 0x7FFFF000;
+  static constexpr intptr_t kJalRange = 0xFFFFE;
+
+  // A literal load to fix up once the pool is placed
+  struct LiteralLoad {
+    uint16_t position;
+    uint8_t literal;
+    bool jump;
+  };
+
+  RelocatedCode* relocated_;
+  // The pool is small enough for a linear search
+  uint64_t literals_[RelocatedCode::kMaxLiterals];
+  LiteralLoad loads_[RelocatedCode::kMaxLiterals];
+  uint8_t literal_count_{};
+  uint8_t load_count_{};
+  bool overflowed_{};
   uintptr_t pc_{};
   uint8_t state_{};
   bool returned_{};
 
-  explicit RV64Relocator(Assembler& assembler) : assembler_(assembler) {
+  explicit RV64Relocator(RelocatedCode* relocated) : relocated_(relocated) {
+    relocated_->code_size = 0;
+    relocated_->literal_count = 0;
+    relocated_->load_count = 0;
   }
 
   void SetPC(uintptr_t pc) {
@@ -305,16 +337,174 @@ class RV64Relocator {
     }
   }
 
+  [[nodiscard]] uint16_t code_size() const {
+    return relocated_->code_size;
+  }
+
+  void Emit16(uint16_t value) {
+    if (code_size() + sizeof(value) > sizeof(relocated_->code)) [[unlikely]] {
+      overflowed_ = true;
+      return;
+    }
+    libc_memcpy(relocated_->code + code_size(), &value, sizeof(value));
+    relocated_->code_size += sizeof(value);
+  }
+
+  void Emit32(uint32_t value) {
+    Emit16(static_cast<uint16_t>(value));
+    Emit16(static_cast<uint16_t>(value >> 16));
+  }
+
+  void Patch32(uint16_t position, uint32_t value) {
+    if (overflowed_) return;
+    libc_memcpy(relocated_->code + position, &value, sizeof(value));
+  }
+
+  static uint32_t EncodeJal(uint32_t rd, int32_t offset) {
+    return 0x0000006f | (rd << 7) | Assembler::JImmediate(offset).EncodedValue();
+  }
+
+  static uint32_t EncodeJalr(uint32_t rd, uint32_t rs1) {
+    return 0x00000067 | (rd << 7) | (rs1 << 15);
+  }
+
+  // auipc rd, 0
+  // ld    rd, 0(rd)
+  // With the offsets filled in by EmitLiterals, `jump` when a jalr through rd follows
+  void LoadAddress(uint32_t rd, uint64_t address, bool jump = false) {
+    uint8_t literal = 0;
+    while (literal < literal_count_ && literals_[literal] != address) ++literal;
+    if (literal == literal_count_) {
+      if (literal_count_ == RelocatedCode::kMaxLiterals) [[unlikely]] {
+        overflowed_ = true;
+        return;
+      }
+      literals_[literal_count_++] = address;
+    }
+    if (load_count_ == RelocatedCode::kMaxLiterals) [[unlikely]] {
+      overflowed_ = true;
+      return;
+    }
+    loads_[load_count_++] = {code_size(), literal, jump};
+    Emit32(0x00000017 | (rd << 7));
+    Emit32(0x00003003 | (rd << 7) | (rd << 15));
+  }
+
   void JumpAddress(uint64_t address) {
-    assembler_.Ld(Assembler::TMP_GENERIC_REGISTER, addresses_[address]);
-    assembler_.Jr(Assembler::TMP_GENERIC_REGISTER);
+    LoadAddress(kTmp, address, true);
+    Emit32(EncodeJalr(kZero, kTmp));
+  }
+
+  bool EmitLiterals() {
+    // Never executed, only keeps the literals 8-byte aligned
+    while (code_size() % sizeof(uint64_t) != 0) Emit16(0);
+    uint16_t positions[RelocatedCode::kMaxLiterals];
+    for (uint8_t i = 0; i < literal_count_; ++i) {
+      positions[i] = code_size();
+      Emit32(static_cast<uint32_t>(literals_[i]));
+      Emit32(static_cast<uint32_t>(literals_[i] >> 32));
+    }
+    if (overflowed_) return false;
+
+    for (uint8_t i = 0; i < load_count_; ++i) {
+      auto [position, literal, jump] = loads_[i];
+      auto offset = static_cast<int32_t>(positions[literal] - position);
+      auto low = static_cast<int32_t>(static_cast<uint32_t>(offset) << 20) >> 20;
+      uint32_t auipc, ld;
+      libc_memcpy(&auipc, relocated_->code + position, sizeof(auipc));
+      libc_memcpy(&ld, relocated_->code + position + 4, sizeof(ld));
+      Patch32(position, auipc | static_cast<uint32_t>(offset - low));
+      Patch32(position + 4, ld | (static_cast<uint32_t>(low) << 20));
+      relocated_->loads[i] = {position, jump};
+    }
+    relocated_->load_count = load_count_;
+    for (uint8_t i = 0; i < literal_count_; ++i) {
+      relocated_->literals[i] = positions[i];
+    }
+    relocated_->literal_count = literal_count_;
+    return true;
+  }
+
+  static uint32_t Read32(const uint8_t* code) {
+    uint32_t value;
+    libc_memcpy(&value, code, sizeof(value));
+    return value;
+  }
+
+  static void Write32(uint8_t* code, uint32_t value) {
+    libc_memcpy(code, &value, sizeof(value));
+  }
+
+  // Splits `value` into the upper immediate of auipc or lui and the 12-bit signed low part
+  static std::tuple<uint32_t, int32_t> SplitImmediate(int64_t value) {
+    auto low = static_cast<int32_t>(static_cast<uint32_t>(value) << 20) >> 20;
+    return {static_cast<uint32_t>(value - low), low};
+  }
+
+  static uint32_t EncodeAddi(uint32_t rd, uint32_t rs1, int32_t imm) {
+    return 0x00000013 | (rd << 7) | (rs1 << 15) | (static_cast<uint32_t>(imm) << 20);
   }
 
-  void EmitAddresses() {
-    for (auto& p : addresses_) {
-      assembler_.Bind(&p.second);
-      assembler_.Emit64(p.first);
+  // Rewrites an installed literal load in place, the literal itself stays but is not read:
+  //   load: auipc + addi within 2 GiB, else lui + addi for a 32-bit address
+  //   jump: jal within 1 MiB, else auipc or lui + jalr the same way
+  // Calls keep the jump last so that they still return past the sequence
+  static void Materialize(uint8_t* code, const RelocatedCode::Load& load) {
+    auto site = code + load.position;
+    auto auipc = Read32(site);
+    auto ld = Read32(site + 4);
+    auto rd = (auipc >> 7) & 0x1f;
+    auto literal = static_cast<int32_t>(auipc & 0xfffff000) + (static_cast<int32_t>(ld) >> 20);
+    uint64_t value;
+    libc_memcpy(&value, site + literal, sizeof(value));
+
+    if (load.jump) {
+      auto link = (Read32(site + 8) >> 7) & 0x1f;
+      auto last = link == kZero ? site : site + 8;
+      auto offset = static_cast<intptr_t>(value) - reinterpret_cast<intptr_t>(last);
+      if (offset >= -kJalRange && offset <= kJalRange) {
+        if (link != kZero) {
+          Write32(site, kNop);
+          Write32(site + 4, kNop);
+        }
+        Write32(last, EncodeJal(link, static_cast<int32_t>(offset)));
+        return;
+      }
+      auto first = link == kZero ? site : site + 4;
+      uint32_t upper, low;
+      if (!MaterializeUpper(rd, value, reinterpret_cast<uintptr_t>(first), &upper, &low)) return;
+      if (link != kZero) Write32(site, kNop);
+      Write32(first, upper);
+      Write32(first + 4, EncodeJalr(link, rd) | (low << 20));
+      return;
+    }
+
+    uint32_t upper, low;
+    if (!MaterializeUpper(rd, value, reinterpret_cast<uintptr_t>(site), &upper, &low)) return;
+    Write32(site, upper);
+    Write32(site + 4, EncodeAddi(rd, rd, static_cast<int32_t>(low)));
+  }
+
+  // auipc rd or lui rd for `value` as seen from `pc`, leaving the low 12 bits to the instruction
+  // that follows. False if neither reaches
+  static bool MaterializeUpper(uint32_t rd, uint64_t value, uintptr_t pc, uint32_t* upper,
+                               uint32_t* low) {
+    auto offset = static_cast<intptr_t>(value - pc);
+    if (offset >= -static_cast<intptr_t>(kPCRelativeRange) &&
+        offset < static_cast<intptr_t>(kPCRelativeRange)) {
+      auto [high, rest] = SplitImmediate(offset);
+      *upper = 0x00000017 | (rd << 7) | high;
+      *low = static_cast<uint32_t>(rest) & 0xfff;
+      return true;
+    }
+    if (auto absolute = static_cast<int64_t>(value);
+        absolute >= INT32_MIN && absolute < INT32_MAX - 0x7ff) {
+      auto [high, rest] = SplitImmediate(absolute);
+      *upper = 0x00000037 | (rd << 7) | high;
+      *low = static_cast<uint32_t>(rest) & 0xfff;
+      return true;
     }
+    return false;
   }
 };
 
@@ -19,8 +19,11 @@
 #include "arch/common/asm.h"
 #include "arch/common/trampoline.h"
 #include "arch/riscv64/riscv64_relocator.h"
+#include "arch/riscv64/riscv64_trampoline_generator.h"
 #include "config.h"
+#include "core/icache.h"
 #include "core/memory.h"
+#include "core/shadow_stack.h"
 
 namespace rv64hook {
 
@@ -28,6 +31,14 @@ size_t InstructionRelocator::Relocate(const void* address, int size, void** relo
   return RV64Relocator::Relocate(static_cast<const uint16_t*>(address), size, relocated);
 }
 
+bool InstructionRelocator::Prepare(const void* address, int size, RelocatedCode* relocated) {
+  return RV64Relocator::Prepare(static_cast<const uint16_t*>(address), size, relocated);
+}
+
+void* InstructionRelocator::Install(const RelocatedCode& relocated) {
+  return RV64Relocator::Install(relocated);
+}
+
 bool Trampoline::IsValid(TrampolineType type) {
   switch (type) {
     case TrampolineType::kWide:
@@ -91,6 +102,29 @@ class [[gnu::packed]] WideTrampoline {
   [[maybe_unused]] void* address_;                // .quad xxx
 };
 
+// Per-hook entry into the shared generic code, with TMP_DATA_REGISTER pointing at the
+// TrampolineData that follows. The second half is where the backup returns when post handlers
+// run, since nothing else is left to find the data with
+class [[gnu::packed]] TrampolineStub {
+ private:
+  static constexpr uint32_t kLoad = 0x000ebe03 | (TrampolineData_dispatcher << 20);
+  static constexpr uint32_t kReturnJump = 0x000e0067 | (Dispatcher_return << 20);
+
+  [[maybe_unused]] uint32_t entry_ = 0x00000013;         // nop, see SetSecondTrampolineEntry
+  [[maybe_unused]] uint32_t auipc_ = 0x00000e97;         // auipc t4, 0
+  [[maybe_unused]] uint16_t addi_ = 0x0ef1;              // c.addi t4, 28
+  [[maybe_unused]] uint32_t load_ = kLoad;               // ld t3, dispatcher(t4)
+  [[maybe_unused]] uint16_t jump_ = 0x8e02;              // jr t3
+  [[maybe_unused]] uint32_t return_auipc_ = 0x00000e97;  // auipc t4, 0
+  [[maybe_unused]] uint16_t return_addi_ = 0x0ec1;       // c.addi t4, 16
+  [[maybe_unused]] uint32_t return_load_ = kLoad;        // ld t3, dispatcher(t4)
+  [[maybe_unused]] uint32_t return_jump_ = kReturnJump;  // jr 32(t3)
+  [[maybe_unused]] uint16_t padding_ = 0x0001;           // c.nop
+};
+
+static_assert(sizeof(TrampolineStub) == 32, "Bad stub layout");
+static_assert(sizeof(TrampolineStub) - 16 == Stub_return_to_data, "Bad stub layout");
+
 int Trampoline::GetFirstTrampolineSize(TrampolineType type) {
   switch (type) {
     case TrampolineType::kPC20:
@@ -103,7 +137,10 @@ int Trampoline::GetFirstTrampolineSize(TrampolineType type) {
   }
 }
 
-bool Trampoline::WriteFirstTrampoline(func_t address, void* target, TrampolineType type) {
+bool Trampoline::WriteFirstTrampoline(func_t address,
+                                      void* target,
+                                      TrampolineType type,
+                                      bool flush_cache) {
   size_t size = 0;
   bool copied = false;
 
@@ -145,13 +182,19 @@ bool Trampoline::WriteFirstTrampoline(func_t address, void* target, TrampolineTy
       copied = Memory::Copy(address, &trampoline, sizeof(trampoline));
     }
   }
-  __builtin___clear_cache(static_cast<char*>(address), static_cast<char*>(address) + size);
+  if (flush_cache) {
+    ICache::Invalidate(address, size);
+  }
   return copied;
 }
 
 std::tuple<void*, bool> Trampoline::AllocSecondTrampoline(func_t address) {
-  auto [code, code_size] = GetSecondTrampoline();
-  auto size = code_size + sizeof(TrampolineData);
+  auto dispatcher = GetDispatcher();
+  if (!dispatcher) [[unlikely]] {
+    return {};
+  }
+
+  auto size = sizeof(TrampolineStub) + sizeof(TrampolineData);
   uintptr_t start = 0, end = 0;
 
   bool is_user_alloc = false;
@@ -178,14 +221,13 @@ std::tuple<void*, bool> Trampoline::AllocSecondTrampoline(func_t address) {
       break;
   }
 
+  // Stubs are packed into slabs, a chunk each would be mostly padding
   if (!trampoline) {
     if (start || end) {
-      trampoline = Memory::Alloc(size, start, end);
-      if (!trampoline) [[unlikely]] {
-        trampoline = Memory::Alloc(size);
-      }
-    } else {
-      trampoline = Memory::Alloc(size);
+      trampoline = Memory::AllocSlot(size, start, end);
+    }
+    if (!trampoline) {
+      trampoline = Memory::AllocSlot(size, 0, 0);
     }
     if (!trampoline) [[unlikely]] {
       return {};
@@ -193,17 +235,95 @@ std::tuple<void*, bool> Trampoline::AllocSecondTrampoline(func_t address) {
   }
 
   ScopedWritableAllocatedMemory unused(is_user_alloc ? nullptr : trampoline);
-  memcpy(trampoline, code, code_size);
-  memset(static_cast<uint8_t*>(trampoline) + code_size, 0, sizeof(TrampolineData));
-  __builtin___clear_cache(static_cast<char*>(trampoline),
-                          static_cast<char*>(trampoline) + code_size);
+  new (trampoline) TrampolineStub();
+  auto td = new (GetTrampolineData(trampoline)) TrampolineData{};
+  td->dispatcher = dispatcher;
+  ICache::Invalidate(trampoline, sizeof(TrampolineStub));
 
   return {trampoline, is_user_alloc};
 }
 
+void Trampoline::FreeSecondTrampoline(void* trampoline) {
+  Memory::FreeSlot(trampoline);
+}
+
 TrampolineData* Trampoline::GetTrampolineData(void* trampoline) {
   return reinterpret_cast<TrampolineData*>(static_cast<uint8_t*>(trampoline) +
-                                           std::get<1>(GetSecondTrampoline()));
+                                           sizeof(TrampolineStub));
+}
+
+// Also copied when built from source, the shared data in front of it has to be writable
+void* Trampoline::GetDispatcher() {
+  static void* dispatcher = []() -> void* {
+    auto [code, code_size] = GetSecondTrampoline();
+    // Aligned so that the fast path sits in a single cache line
+    static constexpr size_t kAlignment = 64;
+    static constexpr size_t kHeaderSize = -Dispatcher_pop_return_address;
+    auto memory = Memory::Alloc(kHeaderSize + code_size + kAlignment);
+    if (!memory) [[unlikely]] {
+      return nullptr;
+    }
+    auto dispatcher =
+        __builtin_align_up(static_cast<uint8_t*>(memory) + kHeaderSize, kAlignment);
+    ScopedWritableAllocatedMemory unused(memory);
+    if (STORE_RETURN_ADDRESS_BY_TLS) {
+      auto pop = ShadowStack::Pop;
+      auto push = ShadowStack::Push;
+      memcpy(dispatcher + Dispatcher_pop_return_address, &pop, sizeof(pop));
+      memcpy(dispatcher + Dispatcher_push_return_address, &push, sizeof(push));
+    } else {
+      memset(dispatcher - kHeaderSize, 0, kHeaderSize);
+    }
+    memcpy(dispatcher, code, code_size);
+    ICache::Invalidate(dispatcher, code_size);
+    return dispatcher;
+  }();
+  return dispatcher;
+}
+
+void* Trampoline::GenerateSecondTrampoline(void* trampoline, const TrampolineShape& shape) {
+  auto td = GetTrampolineData(trampoline);
+  auto entry = reinterpret_cast<uintptr_t>(trampoline);
+
+  // The size does not depend on where the code lands, so measure it first
+  size_t size;
+  {
+    berberis::MachineCode code;
+    RV64TrampolineGenerator::Generate(&code, reinterpret_cast<uintptr_t>(td), td, shape);
+    size = code.install_size();
+  }
+
+  // Reached with a single jal from the entry
+  auto generated = Memory::Alloc(size, entry > 0xFFFFE ? entry - 0xFFFFE : 0, entry + 0xFFFFE);
+  if (!generated) [[unlikely]] {
+    return nullptr;
+  }
+
+  berberis::MachineCode code;
+  RV64TrampolineGenerator::Generate(&code, reinterpret_cast<uintptr_t>(generated), td, shape);
+  if (code.install_size() != size) [[unlikely]] {
+    Memory::Free(generated);
+    return nullptr;
+  }
+
+  ScopedWritableAllocatedMemory unused(generated);
+  berberis::RecoveryMap recovery_map;
+  code.InstallUnsafe(static_cast<uint8_t*>(generated), &recovery_map);
+  ICache::Invalidate(generated, size);
+  return generated;
+}
+
+// The stub starts with a 4 byte nop, which becomes a jal to the specialized code
+void Trampoline::SetSecondTrampolineEntry(void* trampoline, void* code) {
+  uint32_t instruction = 0x00000013;  // nop
+  if (code) {
+    Assembler::RegisterOperand<Assembler::RdMarker, Assembler::Register> rd(Assembler::zero);
+    Assembler::JImmediate imm(reinterpret_cast<intptr_t>(code) -
+                              reinterpret_cast<intptr_t>(trampoline));
+    instruction = 0x6f | rd.EncodeImmediate() | imm.EncodedValue();
+  }
+  __atomic_store_n(static_cast<uint32_t*>(trampoline), instruction, __ATOMIC_RELEASE);
+  ICache::Invalidate(trampoline, sizeof(instruction));
 }
 
 extern "C" void ASM_LABEL(trampoline)();
@@ -216,40 +336,42 @@ std::tuple<const void*, size_t> Trampoline::GetSecondTrampoline() {
               reinterpret_cast<size_t>(ASM_LABEL(trampoline))};
 #else
   static constexpr uint16_t kTrampoline[] = {
-      0x0e17, 0x0000, 0x0e03, 0x312e, 0x0963, 0x000e, 0x0e17, 0x0000, 0x3e03, 0x2e0e, 0x0863,
-      0x000e, 0x8e02, 0x0e17, 0x0000, 0x3e03, 0x2dae, 0x8e02, 0x3423, 0xe021, 0x0113, 0xdf81,
-      0xe406, 0xec0e, 0xf012, 0xf416, 0xf81a, 0xfc1e, 0xe0a2, 0xe4a6, 0xe8aa, 0xecae, 0xf0b2,
-      0xf4b6, 0xf8ba, 0xfcbe, 0xe142, 0xe546, 0xe94a, 0xed4e, 0xf152, 0xf556, 0xf95a, 0xfd5e,
-      0xe1e2, 0xe5e6, 0xe9ea, 0xedee, 0xf1f2, 0xf5f6, 0xf9fa, 0xfdfe, 0xa202, 0xa606, 0xaa0a,
-      0xae0e, 0xb212, 0xb616, 0xba1a, 0xbe1e, 0xa2a2, 0xa6a6, 0xaaaa, 0xaeae, 0xb2b2, 0xb6b6,
-      0xbaba, 0xbebe, 0xa342, 0xa746, 0xab4a, 0xaf4e, 0xb352, 0xb756, 0xbb5a, 0xbf5e, 0xa3e2,
-      0xa7e6, 0xabea, 0xafee, 0xb3f2, 0xb7f6, 0xbbfa, 0xbffe, 0x3023, 0x2001, 0x0597, 0x0000,
-      0xb583, 0x2385, 0xbe03, 0x0205, 0xe072, 0x8e03, 0x0505, 0x0963, 0x000e, 0xbe03, 0x0305,
-      0x0563, 0x000e, 0x0028, 0x61b0, 0x9e02, 0x6582, 0xf1ed, 0x0e17, 0x0000, 0x3e03, 0x230e,
-      0x0963, 0x000e, 0x0517, 0x0000, 0x2503, 0x22c5, 0x65a2, 0x9e02, 0xa801, 0xf057, 0xcd80,
-      0x3e57, 0x5e00, 0x60a2, 0xce57, 0x5e00, 0x0e03, 0x2001, 0x3ffe, 0x3f5e, 0x3ebe, 0x3e1e,
+      0x8e03, 0x01ae, 0x0763, 0x000e, 0xbe03, 0x008e, 0x0663, 0x160e, 0x8e02, 0xbe03, 0x010e,
+      0x8e02, 0x0000, 0x0000, 0x0000, 0x0000, 0x3023, 0xe021, 0x0113, 0xdf01, 0xec0e, 0xf012,
+      0xf416, 0xf81a, 0xfc1e, 0xe0a2, 0xe4a6, 0xe8aa, 0xecae, 0xf0b2, 0xf4b6, 0xf8ba, 0xfcbe,
+      0xe142, 0xe546, 0xe94a, 0xed4e, 0xf152, 0xf556, 0xf95a, 0xfd5e, 0xe1e2, 0xe5e6, 0xe9ea,
+      0xedee, 0xf1f2, 0xf5f6, 0xf9fa, 0xfdfe, 0xa202, 0xa606, 0xaa0a, 0xae0e, 0xb212, 0xb616,
+      0xba1a, 0xbe1e, 0xa2a2, 0xa6a6, 0xaaaa, 0xaeae, 0xb2b2, 0xb6b6, 0xbaba, 0xbebe, 0xa342,
+      0xa746, 0xab4a, 0xaf4e, 0xb352, 0xb756, 0xbb5a, 0xbf5e, 0xa3e2, 0xa7e6, 0xabea, 0xafee,
+      0xb3f2, 0xb7f6, 0xbbfa, 0xbffe, 0x3423, 0x21d1, 0x3023, 0x2001, 0xbe03, 0x020e, 0x3e03,
+      0xff0e, 0x0663, 0x000e, 0x6542, 0x9e02, 0xe42a, 0xa029, 0x0e13, 0x0081, 0x0e27, 0x020e,
+      0x4581, 0xe02e, 0x3e03, 0x2081, 0x3e03, 0x000e, 0x0363, 0x020e, 0x6503, 0x000e, 0xff63,
+      0x00a5, 0x0596, 0x95f2, 0xbe03, 0x0505, 0x0663, 0x000e, 0x0028, 0x6db0, 0x61ac, 0x9e02,
+      0x6582, 0x0585, 0xbfc9, 0x3ffe, 0x3f5e, 0x3ebe, 0x3e1e, 0x2dfe, 0x2d5e, 0x2cbe, 0x2c1e,
+      0x3bfa, 0x3b5a, 0x3aba, 0x3a1a, 0x29fa, 0x295a, 0x28ba, 0x281a, 0x37f6, 0x3756, 0x36b6,
+      0x3616, 0x25f6, 0x2556, 0x24b6, 0x2416, 0x33f2, 0x3352, 0x32b2, 0x3212, 0x21f2, 0x2152,
+      0x20b2, 0x2012, 0x7fee, 0x7f4e, 0x7eae, 0x7e0e, 0x6dee, 0x6d4e, 0x6cae, 0x6c0e, 0x7bea,
+      0x7b4a, 0x7aaa, 0x7a0a, 0x69ea, 0x694a, 0x68aa, 0x680a, 0x77e6, 0x7746, 0x76a6, 0x7606,
+      0x65e6, 0x6546, 0x64a6, 0x6406, 0x73e2, 0x7342, 0x72a2, 0x7202, 0x61e2, 0x60a2, 0x6142,
+      0x8082, 0x3023, 0xe021, 0x0113, 0xdf01, 0xe406, 0xec0e, 0xf012, 0xf416, 0xf81a, 0xfc1e,
+      0xe0a2, 0xe4a6, 0xe8aa, 0xecae, 0xf0b2, 0xf4b6, 0xf8ba, 0xfcbe, 0xe142, 0xe546, 0xe94a,
+      0xed4e, 0xf152, 0xf556, 0xf95a, 0xfd5e, 0xe1e2, 0xe5e6, 0xe9ea, 0xedee, 0xf1f2, 0xf5f6,
+      0xf9fa, 0xfdfe, 0xa202, 0xa606, 0xaa0a, 0xae0e, 0xb212, 0xb616, 0xba1a, 0xbe1e, 0xa2a2,
+      0xa6a6, 0xaaaa, 0xaeae, 0xb2b2, 0xb6b6, 0xbaba, 0xbebe, 0xa342, 0xa746, 0xab4a, 0xaf4e,
+      0xb352, 0xb756, 0xbb5a, 0xbf5e, 0xa3e2, 0xa7e6, 0xabea, 0xafee, 0xb3f2, 0xb7f6, 0xbbfa,
+      0xbffe, 0x3423, 0x21d1, 0x3023, 0x2001, 0x4581, 0xe02e, 0x3e03, 0x2081, 0x3e03, 0x000e,
+      0x0363, 0x020e, 0x6503, 0x000e, 0xff63, 0x00a5, 0x0596, 0x95f2, 0xbe03, 0x0485, 0x0663,
+      0x000e, 0x0028, 0x6db0, 0x61ac, 0x9e02, 0x6582, 0x0585, 0xbfc9, 0x5e7d, 0x0503, 0x2001,
+      0xe90d, 0x3503, 0x2081, 0x5e03, 0x0185, 0x0463, 0x020e, 0x3e03, 0x0205, 0x3e03, 0xff8e,
+      0x0663, 0x000e, 0x6522, 0x65c2, 0x9e02, 0xa801, 0xf057, 0xcd80, 0x3e57, 0x5e00, 0x60a2,
+      0xce57, 0x5e00, 0x4e05, 0xf1f2, 0x3e03, 0x2081, 0xf5f2, 0x3ffe, 0x3f5e, 0x3ebe, 0x3e1e,
       0x2dfe, 0x2d5e, 0x2cbe, 0x2c1e, 0x3bfa, 0x3b5a, 0x3aba, 0x3a1a, 0x29fa, 0x295a, 0x28ba,
       0x281a, 0x37f6, 0x3756, 0x36b6, 0x3616, 0x25f6, 0x2556, 0x24b6, 0x2416, 0x33f2, 0x3352,
       0x32b2, 0x3212, 0x21f2, 0x2152, 0x20b2, 0x2012, 0x7fee, 0x7f4e, 0x7eae, 0x7e0e, 0x6dee,
       0x6d4e, 0x6cae, 0x6c0e, 0x7bea, 0x7b4a, 0x7aaa, 0x7a0a, 0x69ea, 0x694a, 0x68aa, 0x680a,
       0x77e6, 0x7746, 0x76a6, 0x7606, 0x65e6, 0x6546, 0x64a6, 0x6406, 0x73e2, 0x7342, 0x72a2,
-      0x7202, 0x61e2, 0x60a2, 0x6142, 0x1263, 0x160e, 0x0e17, 0x0000, 0x1e03, 0x18ee, 0x08e3,
-      0xe80e, 0x0e17, 0x0000, 0x3e03, 0x166e, 0x9e02, 0x3423, 0xe021, 0x0113, 0xdf81, 0xec0e,
-      0xf012, 0xf416, 0xf81a, 0xfc1e, 0xe0a2, 0xe4a6, 0xe8aa, 0xecae, 0xf0b2, 0xf4b6, 0xf8ba,
-      0xfcbe, 0xe142, 0xe546, 0xe94a, 0xed4e, 0xf152, 0xf556, 0xf95a, 0xfd5e, 0xe1e2, 0xe5e6,
-      0xe9ea, 0xedee, 0xf1f2, 0xf5f6, 0xf9fa, 0xfdfe, 0xa202, 0xa606, 0xaa0a, 0xae0e, 0xb212,
-      0xb616, 0xba1a, 0xbe1e, 0xa2a2, 0xa6a6, 0xaaaa, 0xaeae, 0xb2b2, 0xb6b6, 0xbaba, 0xbebe,
-      0xa342, 0xa746, 0xab4a, 0xaf4e, 0xb352, 0xb756, 0xbb5a, 0xbf5e, 0xa3e2, 0xa7e6, 0xabea,
-      0xafee, 0xb3f2, 0xb7f6, 0xbbfa, 0xbffe, 0x0e17, 0x0000, 0x3e03, 0x0e2e, 0x0963, 0x000e,
-      0x0517, 0x0000, 0x2503, 0x0e65, 0x9e02, 0xe42a, 0xa029, 0x0e13, 0x0081, 0x0e27, 0x020e,
-      0x0597, 0x0000, 0xb583, 0x0a85, 0xbe03, 0x0205, 0xe072, 0x8e03, 0x0505, 0x0963, 0x000e,
-      0xbe03, 0x0385, 0x0563, 0x000e, 0x0028, 0x61b0, 0x9e02, 0x6582, 0xf1ed, 0x3ffe, 0x3f5e,
-      0x3ebe, 0x3e1e, 0x2dfe, 0x2d5e, 0x2cbe, 0x2c1e, 0x3bfa, 0x3b5a, 0x3aba, 0x3a1a, 0x29fa,
-      0x295a, 0x28ba, 0x281a, 0x37f6, 0x3756, 0x36b6, 0x3616, 0x25f6, 0x2556, 0x24b6, 0x2416,
-      0x33f2, 0x3352, 0x32b2, 0x3212, 0x21f2, 0x2152, 0x20b2, 0x2012, 0x7fee, 0x7f4e, 0x7eae,
-      0x7e0e, 0x6dee, 0x6d4e, 0x6cae, 0x6c0e, 0x7bea, 0x7b4a, 0x7aaa, 0x7a0a, 0x69ea, 0x694a,
-      0x68aa, 0x680a, 0x77e6, 0x7746, 0x76a6, 0x7606, 0x65e6, 0x6546, 0x64a6, 0x6406, 0x73e2,
-      0x7342, 0x72a2, 0x7202, 0x61e2, 0x60a2, 0x6142, 0x8082,
+      0x7202, 0x61e2, 0x60a2, 0x6142, 0x4963, 0x000e, 0x0de3, 0xd00e, 0xbe03, 0x010e, 0x8093,
+      0xff0e, 0x8e02, 0x8082,
   };
   return {kTrampoline, sizeof(kTrampoline)};
 #endif
@@ -0,0 +1,722 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#include "arch/common/trampoline.h"
+#include "arch/riscv64/riscv64_relocator.h"
+#include "config.h"
+#include "core/call_recorder.h"
+#include "core/shadow_stack.h"
+
+namespace rv64hook {
+
+// Emits a second trampoline for one shape of handle list. It runs the same protocol as the
+// generic `trampoline` in trampoline_riscv64.S, minus the parts the shape cannot reach
+class RV64TrampolineGenerator {
+ public:
+  using Register = Assembler::Register;
+  using FpRegister = Assembler::FpRegister;
+
+  // TrampolineData is addressed pc-relative, so the code is only valid when placed at `pc`
+  static void Generate(berberis::MachineCode* code,
+                       uintptr_t pc,
+                       const TrampolineData* td,
+                       const TrampolineShape& shape) {
+    Assembler assembler(code);
+    RV64TrampolineGenerator generator(assembler, pc, td);
+    generator.Emit(shape, STORE_RETURN_ADDRESS_BY_TLS);
+    assembler.Finalize();
+  }
+
+ private:
+  // One slot more than the generic frame for RegisterContext::vector_, which keeps sp 16-byte
+  // aligned for the handlers
+  static constexpr int kFrameSize = 8 * 66;
+  static constexpr int kSkipOffset = 8 * 64;
+  static constexpr int kVectorOffset = 8 * 65;
+  // vl, vtype, vlenb and padding in front of v0-v31
+  static constexpr int kVectorHeaderSize = 8 * 4;
+  // ra, a0-a7 and fa0-fa7, rounded up to keep sp 16-byte aligned
+  static constexpr int kProbeFrameSize = 8 * 18;
+
+  static constexpr uint32_t kVsetivliE64 = 0xcd80f057;  // vsetivli zero, 1, e64, m1, ta, ma
+  static constexpr uint32_t kTmpVectorRegister = 28;    // TMP_VECTOR_REGISTER
+  static constexpr uint32_t kVs8r = 0xe2800027;         // vs8r.v v0, (x0)
+  static constexpr uint32_t kVl8r = 0xe2800007;         // vl8r.v v0, (x0)
+  static constexpr uint32_t kVsetvl = 0x80007057;       // vsetvl x0, x0, x0
+  static constexpr uint32_t kRdtime = 0xc0102073;       // rdtime x0
+
+  static_assert(sizeof(RegisterContext) == kVectorOffset, "RegisterContext does not fit the frame");
+
+  Assembler& assembler_;
+  uintptr_t pc_;
+  uintptr_t td_;
+
+  RV64TrampolineGenerator(Assembler& assembler, uintptr_t pc, const TrampolineData* td)
+      : assembler_(assembler), pc_(pc), td_(reinterpret_cast<uintptr_t>(td)) {
+  }
+
+  Assembler::Label& Data(size_t offset) {
+    auto label = assembler_.MakeLabel();
+    label->Bind(static_cast<uint32_t>(td_ + offset - pc_));
+    return *label;
+  }
+
+  void Emit(const TrampolineShape& shape, bool shadow) {
+    auto& jump_backup = *assembler_.MakeLabel();
+    auto& ret = *assembler_.MakeLabel();
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+
+    assembler_.Lb(t3, Data(offsetof(TrampolineData, enabled)));
+    assembler_.Beqz(t3, jump_backup);
+    if (shape.thread_filter != ThreadFilter::kNone) {
+      FilterThread(shape.thread_filter, shape.enabled_by_default, jump_backup);
+    }
+
+    // The start time rides on the shadow stack, so timing needs one
+    auto timed = shadow && shape.stats_slot != CallRecorder::kNoSlot;
+    auto target = shape.replace ? offsetof(TrampolineData, hook) : offsetof(TrampolineData, backup);
+
+    if (shape.replace && !timed) {
+      assembler_.Ld(t3, Data(offsetof(TrampolineData, hook)));
+      assembler_.Jr(t3);
+    } else {
+      auto pre = shape.table_handlers ? shape.has_pre_handlers : !shape.pre_handlers.empty();
+      auto post = shape.table_handlers ? shape.has_post_handlers : !shape.post_handlers.empty();
+      // The target is called rather than jumped to
+      auto call = post || timed;
+
+      auto group = shape.reentrancy_group;
+      // Reentrant calls are not sampled either
+      if (group != ReentrancyGuard::kNone) CheckReentrancy(group, jump_backup);
+      if (shape.sampled) Sample(shape.sampling, shape.sampler, jump_backup);
+
+      auto probes_only = pre && !call && !shape.table_handlers &&
+                         std::all_of(shape.pre_handlers.begin(),
+                                     shape.pre_handlers.end(),
+                                     [](const HandlerCall& handler) { return handler.probe; });
+
+      if (probes_only) {
+        CallProbes(shape.pre_handlers, group);
+      } else if (pre || (call && shadow)) {
+        // Without pre handlers the context is only needed around the shadow stack push
+        SaveRegisters(shape.context, true);
+        if (pre) {
+          InitFrame(shape.context);
+          SetReentrancyFlag(group, true);
+          if (shape.table_handlers) {
+            CallTableHandlers(HandlerEntry_pre_handler);
+          } else {
+            CallHandlers(shape.pre_handlers);
+          }
+          SetReentrancyFlag(group, false);
+        }
+        if (call && shadow) {
+          // Nothing to pop when the call is skipped
+          auto& pushed = *assembler_.MakeLabel();
+          if (pre) {
+            assembler_.Lb(t3, {.base = Assembler::sp, .disp = kSkipOffset});
+            assembler_.Bnez(t3, pushed);
+          }
+          PushReturnAddress(timed);
+          assembler_.Bind(&pushed);
+        }
+        if (pre) {
+          assembler_.Lb(t3, {.base = Assembler::sp, .disp = kSkipOffset});
+        }
+        RestoreRegisters(shape.context, !pre);
+        if (pre) {
+          assembler_.Bnez(t3, ret);
+        }
+      }
+
+      if (call) {
+        if (!shadow) StashReturnAddress(shape.context);
+        assembler_.Ld(t3, Data(target));
+        assembler_.Jalr(t3);
+
+        SaveRegisters(shape.context, false);
+        if (timed) {
+          assembler_.Emit32(kRdtime | (Register(Assembler::a1).GetPhysicalIndex() << 7));
+          assembler_.Sd(Assembler::a1, {.base = Assembler::sp, .disp = 0});
+        }
+        InitFrame(shape.context);
+        if (shadow) {
+          PopReturnAddress(timed);
+        } else {
+          UnstashReturnAddress(shape.context);
+          assembler_.Sd(t3, {.base = Assembler::sp, .disp = 8});
+        }
+        if (timed) RecordCall(shape.stats_slot);
+        if (post) {
+          SetReentrancyFlag(group, true);
+          if (shape.table_handlers) {
+            CallTableHandlers(HandlerEntry_post_handler);
+          } else {
+            CallHandlers(shape.post_handlers);
+          }
+          SetReentrancyFlag(group, false);
+        }
+        RestoreRegisters(shape.context);
+        assembler_.Ret();
+      }
+    }
+
+    assembler_.Bind(&jump_backup);
+    assembler_.Ld(t3, Data(offsetof(TrampolineData, backup)));
+    assembler_.Jr(t3);
+
+    // A pre handler asked to skip the function
+    assembler_.Bind(&ret);
+    assembler_.Ret();
+  }
+
+  // Same frame as the sregs macro, x<n> at 8 * n and f<n> at 8 * (32 + n). The layout does not
+  // depend on the level, only which slots are filled
+  void SaveRegisters(ContextLevel level, bool store_ra) {
+    if (level == ContextLevel::kVector) {
+      // The vector area sits between the frame and the caller's stack
+      auto t3 = Assembler::TMP_GENERIC_REGISTER;
+      assembler_.Csrrs(t3, berberis::riscv::Csr::kVlenb, Assembler::zero);
+      assembler_.Slli(t3, t3, 5);
+      assembler_.Addi(t3, t3, kFrameSize + kVectorHeaderSize);
+      assembler_.Sub(t3, Assembler::sp, t3);
+      assembler_.Sd(Assembler::sp, {.base = t3, .disp = 16});
+      assembler_.Mv(Assembler::sp, t3);
+    } else {
+      assembler_.Sd(Assembler::sp, {.base = Assembler::sp, .disp = -(kFrameSize - 16)});
+      assembler_.Addi(Assembler::sp, Assembler::sp, -kFrameSize);
+    }
+    if (store_ra) {
+      assembler_.Sd(Assembler::ra, {.base = Assembler::sp, .disp = 8});
+    }
+    auto [first, last] = GetRegisterRange(level);
+    for (auto i = first; i <= last; ++i) {
+      assembler_.Sd(Register(static_cast<uint8_t>(i)), {.base = Assembler::sp, .disp = 8 * i});
+    }
+    auto [first_fp, last_fp] = GetFpRegisterRange(level);
+    for (auto i = first_fp; i <= last_fp; ++i) {
+      assembler_.Fsd(kFpRegisters[i], {.base = Assembler::sp, .disp = 8 * (32 + i)});
+    }
+    if (level == ContextLevel::kVector) {
+      SaveVectorRegisters();
+    }
+  }
+
+  // TMP_GENERIC_REGISTER is dead on entry, so it may carry a value out of the frame
+  void RestoreRegisters(ContextLevel level, bool restore_tmp = true) {
+    if (level == ContextLevel::kVector) {
+      RestoreVectorRegisters();
+    }
+    auto [first_fp, last_fp] = GetFpRegisterRange(level);
+    for (auto i = last_fp; i >= first_fp; --i) {
+      assembler_.Fld(kFpRegisters[i], {.base = Assembler::sp, .disp = 8 * (32 + i)});
+    }
+    auto [first, last] = GetRegisterRange(level);
+    for (auto i = last; i >= first; --i) {
+      Register reg(static_cast<uint8_t>(i));
+      if (!restore_tmp && reg == Assembler::TMP_GENERIC_REGISTER) continue;
+      assembler_.Ld(reg, {.base = Assembler::sp, .disp = 8 * i});
+    }
+    assembler_.Ld(Assembler::ra, {.base = Assembler::sp, .disp = 8});
+    assembler_.Ld(Assembler::sp, {.base = Assembler::sp, .disp = 16});
+  }
+
+  // Whole registers in groups of 8, they do not depend on vl and vtype. a0-a2 are free once
+  // they are in the frame
+  void SaveVectorRegisters() {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    assembler_.Addi(a0, Assembler::sp, kFrameSize);
+    assembler_.Sd(a0, {.base = Assembler::sp, .disp = kVectorOffset});
+    assembler_.Csrrs(a1, berberis::riscv::Csr::kVl, Assembler::zero);
+    assembler_.Sd(a1, {.base = a0, .disp = 0});
+    assembler_.Csrrs(a1, berberis::riscv::Csr::kVtype, Assembler::zero);
+    assembler_.Sd(a1, {.base = a0, .disp = 8});
+    assembler_.Csrrs(a1, berberis::riscv::Csr::kVlenb, Assembler::zero);
+    assembler_.Sd(a1, {.base = a0, .disp = 16});
+    assembler_.Slli(a1, a1, 3);
+    assembler_.Addi(a0, a0, kVectorHeaderSize);
+    for (uint32_t v = 0; v < 32; v += 8) {
+      if (v) assembler_.Add(a0, a0, a1);
+      assembler_.Emit32(kVs8r | (v << 7) | (a0.GetPhysicalIndex() << 15));
+    }
+  }
+
+  // Leaves TMP_GENERIC_REGISTER alone, vl and vtype go last since handlers may change them
+  void RestoreVectorRegisters() {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    auto a2 = Assembler::a2;
+    assembler_.Ld(a0, {.base = Assembler::sp, .disp = kVectorOffset});
+    assembler_.Csrrs(a1, berberis::riscv::Csr::kVlenb, Assembler::zero);
+    assembler_.Slli(a1, a1, 3);
+    assembler_.Addi(a2, a0, kVectorHeaderSize);
+    for (uint32_t v = 0; v < 32; v += 8) {
+      if (v) assembler_.Add(a2, a2, a1);
+      assembler_.Emit32(kVl8r | (v << 7) | (a2.GetPhysicalIndex() << 15));
+    }
+    assembler_.Ld(a1, {.base = a0, .disp = 0});
+    assembler_.Ld(a2, {.base = a0, .disp = 8});
+    // vsetvl zero, a1, a2
+    assembler_.Emit32(kVsetvl | (a1.GetPhysicalIndex() << 15) | (a2.GetPhysicalIndex() << 20));
+  }
+
+  // Clears the skip flag and records the level for RegisterContext
+  void InitFrame(ContextLevel level) {
+    if (level == ContextLevel::kFull) {
+      assembler_.Sd(Assembler::zero, {.base = Assembler::sp, .disp = kSkipOffset});
+    } else {
+      auto t3 = Assembler::TMP_GENERIC_REGISTER;
+      assembler_.Addi(t3, Assembler::zero, static_cast<int>(level) << 8);
+      assembler_.Sd(t3, {.base = Assembler::sp, .disp = kSkipOffset});
+    }
+  }
+
+  // gp up to t6, or a0-a7. ra and sp are always in the frame
+  static std::pair<int, int> GetRegisterRange(ContextLevel level) {
+    if (level == ContextLevel::kFull || level == ContextLevel::kVector) return {3, 31};
+    return {10, 17};
+  }
+
+  // fa0-fa7 at every level, they are caller-saved and may hold the arguments or the return
+  // value. kIntegerArguments only hides them from RegisterContext
+  static std::pair<int, int> GetFpRegisterRange(ContextLevel level) {
+    if (level == ContextLevel::kFull || level == ContextLevel::kVector) {
+      return {kFirstFpRegister, kLastFpRegister};
+    }
+    return {10, 17};
+  }
+
+  // Straight-line calls, the handle list is not read at run time. Each handler sees the skip
+  // flag left by the ones before it, like with the callrh loop
+  void CallHandlers(const std::vector<HandlerCall>& handlers) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    for (auto& [handler, handle, data, probe] : handlers) {
+      if (probe) {
+        assembler_.Ld(Assembler::a1, {.base = Assembler::sp, .disp = 8});
+        CallProbe(handle, data, probe);
+        continue;
+      }
+      assembler_.Addi(Assembler::a0, Assembler::sp, 8);
+      assembler_.Li(Assembler::a1, reinterpret_cast<intptr_t>(handle));
+      assembler_.Li(Assembler::a2, reinterpret_cast<intptr_t>(data));
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(handler));
+      assembler_.Jalr(t3);
+    }
+  }
+
+  // The callrh loop of the generic code: the table and its count are reloaded for every entry,
+  // and the index is kept in the frame slot of x0 across the calls
+  void CallTableHandlers(int handler_offset) {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto& loop = *assembler_.MakeLabel();
+    auto& next = *assembler_.MakeLabel();
+    auto& done = *assembler_.MakeLabel();
+
+    assembler_.Li(a1, 0);
+    assembler_.Bind(&loop);
+    assembler_.Sd(a1, {.base = Assembler::sp, .disp = 0});
+    assembler_.Ld(t3, Data(offsetof(TrampolineData, handlers)));
+    assembler_.Beqz(t3, done);
+    assembler_.Lwu(a0, {.base = t3, .disp = HandlerTable_count});
+    assembler_.Bgeu(a1, a0, done);
+    assembler_.Slli(a1, a1, HandlerEntry_shift);
+    assembler_.Add(a1, a1, t3);
+    // A disabled handle keeps its entry with the handlers cleared
+    assembler_.Ld(t3, {.base = a1, .disp = HandlerTable_entries + handler_offset});
+    assembler_.Beqz(t3, next);
+    assembler_.Addi(a0, Assembler::sp, 8);
+    assembler_.Ld(Assembler::a2, {.base = a1, .disp = HandlerTable_entries + HandlerEntry_data});
+    assembler_.Ld(a1, {.base = a1, .disp = HandlerTable_entries + HandlerEntry_handle});
+    assembler_.Jalr(t3);
+    assembler_.Bind(&next);
+    assembler_.Ld(a1, {.base = Assembler::sp, .disp = 0});
+    assembler_.Addi(a1, a1, 1);
+    assembler_.Jal(Assembler::zero, loop);
+    assembler_.Bind(&done);
+  }
+
+  // With the return address already in a1
+  void CallProbe(HookHandle* handle, void* data, ProbeHandler probe) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    assembler_.Li(Assembler::a0, reinterpret_cast<intptr_t>(handle->GetAddress()));
+    assembler_.Li(Assembler::a2, reinterpret_cast<intptr_t>(data));
+    assembler_.Li(t3, reinterpret_cast<intptr_t>(probe));
+    assembler_.Jalr(t3);
+  }
+
+  // Only probes and no post handlers, so no RegisterContext is built. ra, a0-a7 and fa0-fa7 are
+  // what the C ABI lets the probes clobber that the function may still need on entry
+  void CallProbes(const std::vector<HandlerCall>& probes, int8_t group) {
+    auto sp = Assembler::sp;
+    assembler_.Addi(sp, sp, -kProbeFrameSize);
+    assembler_.Sd(Assembler::ra, {.base = sp, .disp = 0});
+    for (int i = 10; i <= 17; ++i) {
+      assembler_.Sd(Register(static_cast<uint8_t>(i)), {.base = sp, .disp = 8 * (i - 9)});
+      assembler_.Fsd(kFpRegisters[i], {.base = sp, .disp = 8 * (i - 1)});
+    }
+    SetReentrancyFlag(group, true);
+    for (auto& [handler, handle, data, probe] : probes) {
+      assembler_.Ld(Assembler::a1, {.base = sp, .disp = 0});
+      CallProbe(handle, data, probe);
+    }
+    SetReentrancyFlag(group, false);
+    for (int i = 17; i >= 10; --i) {
+      assembler_.Fld(kFpRegisters[i], {.base = sp, .disp = 8 * (i - 1)});
+      assembler_.Ld(Register(static_cast<uint8_t>(i)), {.base = sp, .disp = 8 * (i - 9)});
+    }
+    assembler_.Ld(Assembler::ra, {.base = sp, .disp = 0});
+    assembler_.Addi(sp, sp, kProbeFrameSize);
+  }
+
+  // Branches to `skip` when the function is disabled on the calling thread. Without static TLS
+  // the bitmaps are only reachable through a call, which needs the arguments saved
+  void FilterThread(int16_t index, bool enabled_by_default, const Assembler::Label& skip) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto t4 = Assembler::t4;
+
+    intptr_t offset;
+    if (ThreadFilter::GetThreadPointerOffset(&offset)) {
+      auto bitmap = enabled_by_default ? offsetof(ThreadFilter::Block, disabled)
+                                       : offsetof(ThreadFilter::Block, enabled);
+      assembler_.Li(t4, offset + bitmap + index / 64 * sizeof(uint64_t));
+      assembler_.Add(t4, t4, Assembler::tp);
+      assembler_.Ld(t3, {.base = t4, .disp = 0});
+      if (index % 64) assembler_.Srli(t3, t3, index % 64);
+      assembler_.Andi(t3, t3, 1);
+    } else {
+      SaveRegisters(ContextLevel::kIntegerArguments, true);
+      assembler_.Li(Assembler::a0, index);
+      assembler_.Li(Assembler::a1, enabled_by_default);
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(&ThreadFilter::IsEnabled));
+      assembler_.Jalr(t3);
+      assembler_.Xori(t3, Assembler::a0, enabled_by_default);
+      RestoreRegisters(ContextLevel::kIntegerArguments, false);
+    }
+    // t3 is the thread's bit in the bitmap that overrides the default
+    if (enabled_by_default) {
+      assembler_.Bnez(t3, skip);
+    } else {
+      assembler_.Beqz(t3, skip);
+    }
+  }
+
+  // Branches to `skip` when a handler of the group is running on the calling thread, the same
+  // way FilterThread() reads the flag
+  void CheckReentrancy(int8_t group, const Assembler::Label& skip) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto t4 = Assembler::t4;
+
+    intptr_t offset;
+    if (ReentrancyGuard::GetThreadPointerOffset(&offset)) {
+      assembler_.Li(t4, offset + offsetof(ReentrancyGuard::Block, active) + group);
+      assembler_.Add(t4, t4, Assembler::tp);
+      assembler_.Lbu(t3, {.base = t4, .disp = 0});
+    } else {
+      SaveRegisters(ContextLevel::kIntegerArguments, true);
+      assembler_.Li(Assembler::a0, group);
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(&ReentrancyGuard::IsActive));
+      assembler_.Jalr(t3);
+      assembler_.Mv(t3, Assembler::a0);
+      RestoreRegisters(ContextLevel::kIntegerArguments, false);
+    }
+    assembler_.Bnez(t3, skip);
+  }
+
+  // Inside the frame, where the handlers may clobber t3 and t4 anyway
+  void SetReentrancyFlag(int8_t group, bool active) {
+    if (group == ReentrancyGuard::kNone) return;
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto t4 = Assembler::t4;
+
+    intptr_t offset;
+    if (ReentrancyGuard::GetThreadPointerOffset(&offset)) {
+      assembler_.Li(t4, offset + offsetof(ReentrancyGuard::Block, active) + group);
+      assembler_.Add(t4, t4, Assembler::tp);
+      if (active) {
+        assembler_.Li(t3, 1);
+        assembler_.Sb(t3, {.base = t4, .disp = 0});
+      } else {
+        assembler_.Sb(Assembler::zero, {.base = t4, .disp = 0});
+      }
+    } else {
+      assembler_.Li(Assembler::a0, group);
+      assembler_.Li(Assembler::a1, active);
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(&ReentrancyGuard::SetActive));
+      assembler_.Jalr(t3);
+    }
+  }
+
+  // Branches to `skip` for calls that are not sampled. Nothing is saved yet, so it only has t3
+  // and t4, which are caller-saved and dead on entry
+  void Sample(SamplingMode mode, Sampler::State* sampler, const Assembler::Label& skip) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto t4 = Assembler::t4;
+    auto state = [&]() { assembler_.Li(t4, reinterpret_cast<intptr_t>(sampler)); };
+
+    if (mode == SamplingMode::kEveryNth) {
+      auto& sampled = *assembler_.MakeLabel();
+      state();
+      assembler_.Lw(t3, {.base = t4, .disp = offsetof(Sampler::State, countdown)});
+      assembler_.Addi(t3, t3, -1);
+      assembler_.Blez(t3, sampled);
+      assembler_.Sw(t3, {.base = t4, .disp = offsetof(Sampler::State, countdown)});
+      assembler_.Jal(Assembler::zero, skip);
+      assembler_.Bind(&sampled);
+      assembler_.Lwu(t3, {.base = t4, .disp = offsetof(Sampler::State, rate)});
+      assembler_.Sw(t3, {.base = t4, .disp = offsetof(Sampler::State, countdown)});
+      return;
+    }
+
+    // xorshift64 with shifts 7 and 9, t4 is needed as a temporary in between
+    intptr_t offset;
+    auto tls = Sampler::GetThreadPointerOffset(&offset);
+    auto seed = [&]() {
+      if (tls) {
+        assembler_.Li(t4, offset);
+        assembler_.Add(t4, t4, Assembler::tp);
+      } else {
+        state();
+        assembler_.Addi(t4, t4, offsetof(Sampler::State, seed));
+      }
+    };
+    auto& seeded = *assembler_.MakeLabel();
+    seed();
+    assembler_.Ld(t3, {.base = t4, .disp = 0});
+    assembler_.Bnez(t3, seeded);
+    assembler_.Mv(t3, Assembler::tp);
+    assembler_.Bind(&seeded);
+    assembler_.Slli(t4, t3, 7);
+    assembler_.Xor(t3, t3, t4);
+    assembler_.Srli(t4, t3, 9);
+    assembler_.Xor(t3, t3, t4);
+    seed();
+    assembler_.Sd(t3, {.base = t4, .disp = 0});
+    // The high word of seed * rate is 0 with a probability of 1 / rate
+    state();
+    assembler_.Lwu(t4, {.base = t4, .disp = offsetof(Sampler::State, rate)});
+    assembler_.Mulhu(t3, t3, t4);
+    assembler_.Bnez(t3, skip);
+  }
+
+  // Inline ShadowStack::Push of the ra and sp in the frame, which only calls out when the block
+  // is full or not in static TLS. Timed calls push the start time as a second entry. a0-a3 are
+  // free once they are in the frame
+  void PushReturnAddress(bool timed) {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    auto a2 = Assembler::a2;
+    auto a3 = Assembler::a3;
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto& call = *assembler_.MakeLabel();
+    auto& done = *assembler_.MakeLabel();
+    constexpr int kEntrySize = sizeof(ShadowStack::Entry);
+
+    intptr_t offset;
+    if (ShadowStack::GetThreadPointerOffset(&offset)) {
+      assembler_.Li(a0, offset);
+      assembler_.Add(a0, a0, Assembler::tp);
+      assembler_.Ld(a1, {.base = a0, .disp = offsetof(ShadowStack::Block, top)});
+      assembler_.Ld(a2, {.base = a0, .disp = offsetof(ShadowStack::Block, limit)});
+      if (timed) {
+        assembler_.Addi(a3, a1, kEntrySize);
+        assembler_.Bgeu(a3, a2, call);
+      } else {
+        assembler_.Bgeu(a1, a2, call);
+      }
+      assembler_.Ld(a2, {.base = Assembler::sp, .disp = 8});
+      assembler_.Sd(a2, {.base = a1, .disp = offsetof(ShadowStack::Entry, return_address)});
+      assembler_.Ld(a2, {.base = Assembler::sp, .disp = 16});
+      assembler_.Sd(a2, {.base = a1, .disp = offsetof(ShadowStack::Entry, sp)});
+      if (timed) {
+        assembler_.Emit32(kRdtime | (a3.GetPhysicalIndex() << 7));
+        assembler_.Sd(a3, {.base = a1, .disp = kEntrySize});
+        assembler_.Sd(a2, {.base = a1, .disp = kEntrySize + 8});
+      }
+      assembler_.Addi(a1, a1, timed ? 2 * kEntrySize : kEntrySize);
+      assembler_.Sd(a1, {.base = a0, .disp = offsetof(ShadowStack::Block, top)});
+      assembler_.Jal(Assembler::zero, done);
+    }
+    assembler_.Bind(&call);
+    assembler_.Li(t3, reinterpret_cast<intptr_t>(&ShadowStack::Push));
+    assembler_.Ld(a0, {.base = Assembler::sp, .disp = 8});
+    assembler_.Ld(a1, {.base = Assembler::sp, .disp = 16});
+    assembler_.Jalr(t3);
+    if (timed) {
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(&ShadowStack::Push));
+      assembler_.Emit32(kRdtime | (a0.GetPhysicalIndex() << 7));
+      assembler_.Ld(a1, {.base = Assembler::sp, .disp = 16});
+      assembler_.Jalr(t3);
+    }
+    assembler_.Bind(&done);
+  }
+
+  // Inline ShadowStack::Pop into the ra slot of the frame, or calls to it. Timed calls turn the
+  // end time at 0(sp) into the elapsed ticks
+  void PopReturnAddress(bool timed) {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    auto a2 = Assembler::a2;
+    auto a3 = Assembler::a3;
+    constexpr int kEntrySize = sizeof(ShadowStack::Entry);
+
+    intptr_t offset;
+    if (ShadowStack::GetThreadPointerOffset(&offset)) {
+      auto& loop = *assembler_.MakeLabel();
+      assembler_.Li(a0, offset);
+      assembler_.Add(a0, a0, Assembler::tp);
+      assembler_.Ld(a1, {.base = a0, .disp = offsetof(ShadowStack::Block, top)});
+      assembler_.Ld(a3, {.base = Assembler::sp, .disp = 16});
+      // Entries left below the caller's sp belong to frames that never returned, the sentinel at
+      // the base ends the search
+      assembler_.Bind(&loop);
+      assembler_.Addi(a1, a1, -kEntrySize);
+      assembler_.Ld(a2, {.base = a1, .disp = offsetof(ShadowStack::Entry, sp)});
+      assembler_.Bltu(a2, a3, loop);
+      if (timed) {
+        assembler_.Ld(a2, {.base = a1, .disp = offsetof(ShadowStack::Entry, return_address)});
+        assembler_.Ld(a3, {.base = Assembler::sp, .disp = 0});
+        assembler_.Sub(a3, a3, a2);
+        assembler_.Sd(a3, {.base = Assembler::sp, .disp = 0});
+        assembler_.Addi(a1, a1, -kEntrySize);
+      }
+      assembler_.Ld(a2, {.base = a1, .disp = offsetof(ShadowStack::Entry, return_address)});
+      assembler_.Sd(a1, {.base = a0, .disp = offsetof(ShadowStack::Block, top)});
+      assembler_.Sd(a2, {.base = Assembler::sp, .disp = 8});
+    } else {
+      auto t3 = Assembler::TMP_GENERIC_REGISTER;
+      if (timed) {
+        assembler_.Li(t3, reinterpret_cast<intptr_t>(&ShadowStack::Pop));
+        assembler_.Ld(a0, {.base = Assembler::sp, .disp = 16});
+        assembler_.Jalr(t3);
+        assembler_.Ld(a1, {.base = Assembler::sp, .disp = 0});
+        assembler_.Sub(a1, a1, a0);
+        assembler_.Sd(a1, {.base = Assembler::sp, .disp = 0});
+      }
+      assembler_.Li(t3, reinterpret_cast<intptr_t>(&ShadowStack::Pop));
+      assembler_.Ld(a0, {.base = Assembler::sp, .disp = 16});
+      assembler_.Jalr(t3);
+      assembler_.Sd(a0, {.base = Assembler::sp, .disp = 8});
+    }
+  }
+
+  // Inline CallRecorder::Record of the ticks at 0(sp) into this thread's slot, which only calls
+  // out the first time the slot is used on a thread or when the table is not in static TLS
+  void RecordCall(int32_t slot) {
+    auto a0 = Assembler::a0;
+    auto a1 = Assembler::a1;
+    auto a2 = Assembler::a2;
+    auto a3 = Assembler::a3;
+    auto a4 = Assembler::a4;
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    auto& call = *assembler_.MakeLabel();
+    auto& done = *assembler_.MakeLabel();
+    auto slot_offset = static_cast<int64_t>(slot) * sizeof(CallStatistics);
+
+    intptr_t offset;
+    if (CallRecorder::GetThreadPointerOffset(&offset)) {
+      auto& loop = *assembler_.MakeLabel();
+      auto& found = *assembler_.MakeLabel();
+      assembler_.Li(a0, offset);
+      assembler_.Add(a0, a0, Assembler::tp);
+      assembler_.Ld(a3, {.base = a0, .disp = offsetof(CallRecorder::Block, size)});
+      assembler_.Li(a4, slot_offset);
+      assembler_.Bgeu(a4, a3, call);
+      assembler_.Ld(a0, {.base = a0, .disp = offsetof(CallRecorder::Block, slots)});
+      assembler_.Add(a0, a0, a4);
+      assembler_.Ld(a2, {.base = Assembler::sp, .disp = 0});
+      assembler_.Ld(a3, {.base = a0, .disp = offsetof(CallStatistics, calls)});
+      assembler_.Addi(a3, a3, 1);
+      assembler_.Sd(a3, {.base = a0, .disp = offsetof(CallStatistics, calls)});
+      assembler_.Ld(a3, {.base = a0, .disp = offsetof(CallStatistics, ticks)});
+      assembler_.Add(a3, a3, a2);
+      assembler_.Sd(a3, {.base = a0, .disp = offsetof(CallStatistics, ticks)});
+      // a0 += floor(log2(ticks)) * 8, a few rounds for the usual short calls
+      assembler_.Bind(&loop);
+      assembler_.Srli(a2, a2, 1);
+      assembler_.Beqz(a2, found);
+      assembler_.Addi(a0, a0, sizeof(uint64_t));
+      assembler_.Jal(Assembler::zero, loop);
+      assembler_.Bind(&found);
+      assembler_.Ld(a3, {.base = a0, .disp = offsetof(CallStatistics, histogram)});
+      assembler_.Addi(a3, a3, 1);
+      assembler_.Sd(a3, {.base = a0, .disp = offsetof(CallStatistics, histogram)});
+      assembler_.Jal(Assembler::zero, done);
+    }
+    assembler_.Bind(&call);
+    assembler_.Li(a0, slot);
+    assembler_.Ld(a1, {.base = Assembler::sp, .disp = 0});
+    assembler_.Li(t3, reinterpret_cast<intptr_t>(&CallRecorder::Record));
+    assembler_.Jalr(t3);
+    assembler_.Bind(&done);
+  }
+
+  // Keeps ra across the backup call without a shadow stack, clobbers vl and vtype like the
+  // generic trampoline does. Hooks that save the vector state stash it in a float register
+  void StashReturnAddress(ContextLevel level) {
+    if (USE_VECTOR_EXTENSION && level != ContextLevel::kVector) {
+      assembler_.Emit32(kVsetivliE64);
+      // vmv.s.x TMP_VECTOR_REGISTER, ra
+      assembler_.Emit32(0x42006057 | (kTmpVectorRegister << 7) | (Register(Assembler::ra).GetPhysicalIndex() << 15));
+    } else {
+      // fmv.d.x TMP_FLOAT_REGISTER, ra
+      assembler_.Emit32(0xf2000053 | (FpRegister(Assembler::TMP_FLOAT_REGISTER).GetPhysicalIndex() << 7) |
+                        (Register(Assembler::ra).GetPhysicalIndex() << 15));
+    }
+  }
+
+  // Into TMP_GENERIC_REGISTER
+  void UnstashReturnAddress(ContextLevel level) {
+    auto t3 = Assembler::TMP_GENERIC_REGISTER;
+    if (USE_VECTOR_EXTENSION && level != ContextLevel::kVector) {
+      assembler_.Emit32(kVsetivliE64);
+      // vmv.x.s TMP_GENERIC_REGISTER, TMP_VECTOR_REGISTER
+      assembler_.Emit32(0x42002057 | (t3.GetPhysicalIndex() << 7) | (kTmpVectorRegister << 20));
+    } else {
+      // fmv.x.d TMP_GENERIC_REGISTER, TMP_FLOAT_REGISTER
+      assembler_.Emit32(0xe2000053 | (t3.GetPhysicalIndex() << 7) |
+                        (FpRegister(Assembler::TMP_FLOAT_REGISTER).GetPhysicalIndex() << 15));
+    }
+  }
+
+#if FULL_FLOATING_POINT_REGISTER_PACK
+  static constexpr int kFirstFpRegister = 0;
+  static constexpr int kLastFpRegister = 31;
+#else
+  static constexpr int kFirstFpRegister = 10;
+  static constexpr int kLastFpRegister = 17;
+#endif
+
+  static constexpr FpRegister kFpRegisters[] = {
+      Assembler::f0,  Assembler::f1,  Assembler::f2,  Assembler::f3,  Assembler::f4,
+      Assembler::f5,  Assembler::f6,  Assembler::f7,  Assembler::f8,  Assembler::f9,
+      Assembler::f10, Assembler::f11, Assembler::f12, Assembler::f13, Assembler::f14,
+      Assembler::f15, Assembler::f16, Assembler::f17, Assembler::f18, Assembler::f19,
+      Assembler::f20, Assembler::f21, Assembler::f22, Assembler::f23, Assembler::f24,
+      Assembler::f25, Assembler::f26, Assembler::f27, Assembler::f28, Assembler::f29,
+      Assembler::f30, Assembler::f31,
+  };
+};
+
+}  // namespace rv64hook
@@ -3,6 +3,7 @@
 
 #if defined(__riscv)
 #define TMP_GENERIC_REGISTER t3
+#define TMP_DATA_REGISTER    t4
 #define TMP_FLOAT_REGISTER   ft11
 #define TMP_VECTOR_REGISTER  v28
 #define USE_VECTOR_EXTENSION IS_VECTOR_SUPPORTED
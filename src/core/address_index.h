@@ -0,0 +1,256 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+// Index of the reader slot of the calling thread, threads are spread round robin so that
+// concurrent readers of an AddressIndex rarely share a cache line
+static inline size_t GetReaderSlot(size_t count) {
+  static constinit std::atomic<size_t> next{0};
+  STATIC_TLS static thread_local size_t slot = 0;
+  if (!slot) [[unlikely]] {
+    slot = next.fetch_add(1, std::memory_order_relaxed) % count + 1;
+  }
+  return slot - 1;
+}
+
+// Open addressing hash table keyed by function address.
+// Find() is wait-free and may run concurrently with writers, Insert() and Erase() are serialized
+// by an internal mutex. Erased slots keep their key as a tombstone until the next rehash,
+// retired tables are freed once no reader can still be walking them.
+template <typename T>
+class AddressIndex {
+ public:
+  constexpr AddressIndex() = default;
+
+  [[nodiscard]] T* Find(const void* address) const {
+    auto& readers = readers_[GetReaderSlot(kReaderSlots)].count;
+    auto epoch = epoch_.load() & 1;
+    readers[epoch].fetch_add(1);
+
+    T* value = nullptr;
+    if (auto table = table_.load(); table) [[likely]] {
+      auto key = reinterpret_cast<uintptr_t>(address);
+      auto mask = table->capacity - 1;
+      auto slots = table->slots();
+      for (size_t i = Index(key, table->shift), n = 0; n < table->capacity;
+           i = (i + 1) & mask, ++n) {
+        auto k = slots[i].key.load(std::memory_order_acquire);
+        if (k == key) {
+          value = slots[i].value.load(std::memory_order_acquire);
+          break;
+        }
+        if (k == 0) break;
+      }
+    }
+
+    readers[epoch].fetch_sub(1, std::memory_order_release);
+    return value;
+  }
+
+  bool Insert(const void* address, T* value) {
+    WriterLocker locker(this);
+    auto table = table_.load(std::memory_order_relaxed);
+    if (!table || (table->used + 1) * 4 > table->capacity * 3) {
+      table = Rehash(size_ + 1);
+      if (!table) [[unlikely]] {
+        return false;
+      }
+    }
+
+    auto key = reinterpret_cast<uintptr_t>(address);
+    auto mask = table->capacity - 1;
+    auto slots = table->slots();
+    for (auto i = Index(key, table->shift);; i = (i + 1) & mask) {
+      auto k = slots[i].key.load(std::memory_order_relaxed);
+      if (k == key) {
+        if (slots[i].value.load(std::memory_order_relaxed)) [[unlikely]] {
+          return false;
+        }
+        slots[i].value.store(value, std::memory_order_release);
+        ++size_;
+        return true;
+      }
+      if (k == 0) {
+        slots[i].value.store(value, std::memory_order_relaxed);
+        slots[i].key.store(key, std::memory_order_release);
+        ++table->used;
+        ++size_;
+        return true;
+      }
+    }
+  }
+
+  T* Erase(const void* address) {
+    WriterLocker locker(this);
+    auto table = table_.load(std::memory_order_relaxed);
+    if (!table) [[unlikely]] {
+      return nullptr;
+    }
+
+    auto key = reinterpret_cast<uintptr_t>(address);
+    auto mask = table->capacity - 1;
+    auto slots = table->slots();
+    for (size_t i = Index(key, table->shift), n = 0; n < table->capacity;
+         i = (i + 1) & mask, ++n) {
+      auto k = slots[i].key.load(std::memory_order_relaxed);
+      if (k == key) {
+        auto value = slots[i].value.exchange(nullptr, std::memory_order_release);
+        if (value) --size_;
+        return value;
+      }
+      if (k == 0) break;
+    }
+    return nullptr;
+  }
+
+  [[nodiscard]] size_t Size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  // Calls `function` with every value under the writer lock, it must not modify the index
+  template <typename Function>
+  void ForEach(Function function) {
+    WriterLocker locker(this);
+    auto table = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; table && i < table->capacity; ++i) {
+      if (auto value = table->slots()[i].value.load(std::memory_order_relaxed)) function(value);
+    }
+  }
+
+ private:
+  class WriterLocker {
+   public:
+    explicit WriterLocker(AddressIndex* index) : mutex_(&index->mutex_) {
+      pthread_mutex_lock(mutex_);
+    }
+
+    ~WriterLocker() {
+      pthread_mutex_unlock(mutex_);
+    }
+
+   private:
+    pthread_mutex_t* mutex_;
+  };
+
+  struct Slot {
+    std::atomic<uintptr_t> key;
+    std::atomic<T*> value;
+  };
+
+  struct alignas(64) Table {
+    size_t capacity;
+    size_t used;
+    uint8_t shift;
+
+    Slot* slots() {
+      return reinterpret_cast<Slot*>(this + 1);
+    }
+  };
+
+  // Readers only touch the line of their own slot, the writer scans all of them
+  struct alignas(64) ReaderSlot {
+    std::atomic<size_t> count[2];
+  };
+
+  static_assert(sizeof(Slot) == 16, "Bad Slot");
+
+  static constexpr size_t kMinCapacity = 16;
+  static constexpr size_t kReaderSlots = 32;
+
+  std::atomic<Table*> table_{nullptr};
+  mutable ReaderSlot readers_[kReaderSlots]{};
+  std::atomic<size_t> epoch_{0};
+  std::atomic<size_t> size_{0};
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+  static size_t Index(uintptr_t key, uint8_t shift) {
+    // Fibonacci hashing, functions are at least 2-byte aligned
+    return static_cast<size_t>(((key >> 1) * 0x9E3779B97F4A7C15ULL) >> shift);
+  }
+
+  Table* Rehash(size_t min_size) {
+    size_t capacity = kMinCapacity;
+    uint8_t shift = 64 - __builtin_ctzll(kMinCapacity);
+    while (capacity < min_size * 2) {
+      capacity *= 2;
+      --shift;
+    }
+
+    auto bytes = sizeof(Table) + capacity * sizeof(Slot);
+    auto table = static_cast<Table*>(aligned_alloc(alignof(Table), bytes));
+    if (!table) [[unlikely]] {
+      return nullptr;
+    }
+    memset(static_cast<void*>(table), 0, bytes);
+    table->capacity = capacity;
+    table->shift = shift;
+
+    auto old = table_.load(std::memory_order_relaxed);
+    if (old) {
+      auto mask = capacity - 1;
+      auto slots = table->slots();
+      auto old_slots = old->slots();
+      for (size_t i = 0; i < old->capacity; ++i) {
+        auto key = old_slots[i].key.load(std::memory_order_relaxed);
+        auto value = old_slots[i].value.load(std::memory_order_relaxed);
+        if (!key || !value) continue;
+        auto j = Index(key, shift);
+        while (slots[j].key.load(std::memory_order_relaxed) != 0) {
+          j = (j + 1) & mask;
+        }
+        slots[j].key.store(key, std::memory_order_relaxed);
+        slots[j].value.store(value, std::memory_order_relaxed);
+        ++table->used;
+      }
+    }
+
+    table_.store(table);
+    if (old) {
+      Synchronize();
+      free(old);
+    }
+    return table;
+  }
+
+  // Waits until every reader that may have loaded the previous table has left
+  void Synchronize() {
+    for (int i = 0; i < 2; ++i) {
+      auto epoch = epoch_.fetch_add(1) & 1;
+      for (auto& readers : readers_) {
+        while (readers.count[epoch].load(std::memory_order_acquire) != 0) {
+          sched_yield();
+        }
+      }
+    }
+  }
+};
+
+}  // namespace rv64hook
@@ -0,0 +1,178 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "call_recorder.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "libc/libc.h"
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+STATIC_TLS static thread_local CallRecorder::Block block_{};
+
+static pthread_mutex_t recorder_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t key_;
+// Tables of the threads that have recorded a call and not exited yet
+static CallRecorder::Block* blocks_ = nullptr;
+// Per slot, counts of exited threads and the sums at the last reset
+static std::vector<CallStatistics> retired_;
+static std::vector<CallStatistics> baseline_;
+static std::vector<int32_t> free_slots_;
+
+static constexpr size_t kMinSlots = 16;
+
+class RecorderLocker {
+ public:
+  RecorderLocker() {
+    pthread_mutex_lock(&recorder_mutex_);
+  }
+
+  ~RecorderLocker() {
+    pthread_mutex_unlock(&recorder_mutex_);
+  }
+};
+
+static void Add(CallStatistics& to, const CallStatistics& from) {
+  to.calls += from.calls;
+  to.ticks += from.ticks;
+  for (int i = 0; i < CallStatistics::kHistogramSize; ++i) {
+    to.histogram[i] += from.histogram[i];
+  }
+}
+
+static void Subtract(CallStatistics& to, const CallStatistics& from) {
+  to.calls -= from.calls;
+  to.ticks -= from.ticks;
+  for (int i = 0; i < CallStatistics::kHistogramSize; ++i) {
+    to.histogram[i] -= from.histogram[i];
+  }
+}
+
+static void Account(CallStatistics* stats, uint64_t ticks) {
+  stats->calls++;
+  stats->ticks += ticks;
+  stats->histogram[ticks ? 63 - __builtin_clzll(ticks) : 0]++;
+}
+
+int32_t CallRecorder::AllocSlot() {
+  RecorderLocker locker;
+  int32_t slot;
+  if (free_slots_.empty()) {
+    slot = static_cast<int32_t>(retired_.size());
+    retired_.emplace_back();
+    baseline_.emplace_back();
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  Sum(slot, &baseline_[slot]);
+  return slot;
+}
+
+void CallRecorder::FreeSlot(int32_t slot) {
+  RecorderLocker locker;
+  free_slots_.push_back(slot);
+}
+
+// The slow path of the trampolines, taken once per thread and table size, or on every call
+// where the table is not in static TLS
+void CallRecorder::Record(uint32_t slot, uint64_t ticks) {
+  auto& block = block_;
+  auto size = (static_cast<size_t>(slot) + 1) * sizeof(CallStatistics);
+  if (block.size < size) [[unlikely]] {
+    // A timed function called while the table grows is not counted
+    if (block.growing) return;
+    Grow(block, size);
+    if (block.size < size) [[unlikely]] return;
+  }
+  Account(&block.slots[slot], ticks);
+}
+
+void CallRecorder::Collect(int32_t slot, CallStatistics* stats) {
+  RecorderLocker locker;
+  Sum(slot, stats);
+  Subtract(*stats, baseline_[slot]);
+}
+
+void CallRecorder::Reset(int32_t slot) {
+  RecorderLocker locker;
+  Sum(slot, &baseline_[slot]);
+}
+
+bool CallRecorder::GetThreadPointerOffset(intptr_t* offset) {
+  return rv64hook::GetThreadPointerOffset(&block_, offset);
+}
+
+// Readers walk the table under the lock, so it is only replaced while holding it
+void CallRecorder::Grow(Block& block, size_t size) {
+  block.growing = true;
+  RecorderLocker locker;
+
+  size = std::max({size, block.size * 2, kMinSlots * sizeof(CallStatistics)});
+  auto slots = static_cast<CallStatistics*>(libc_mmap_anonymous(size));
+  if (slots != MAP_FAILED) [[likely]] {
+    if (block.slots) {
+      libc_memcpy(slots, block.slots, block.size);
+      libc_munmap(block.slots, block.size);
+    } else {
+      block.next = blocks_;
+      if (blocks_) blocks_->previous = &block;
+      blocks_ = &block;
+      pthread_once(&key_once_, [] { pthread_key_create(&key_, Retire); });
+      pthread_setspecific(key_, &block);
+    }
+    block.slots = slots;
+    block.size = size;
+  }
+  block.growing = false;
+}
+
+// Folds the table of an exiting thread into retired_
+void CallRecorder::Retire(void* arg) {
+  auto& block = *static_cast<Block*>(arg);
+  {
+    RecorderLocker locker;
+    auto count = std::min(block.size / sizeof(CallStatistics), retired_.size());
+    for (size_t i = 0; i < count; ++i) {
+      Add(retired_[i], block.slots[i]);
+    }
+    if (block.previous) block.previous->next = block.next;
+    else blocks_ = block.next;
+    if (block.next) block.next->previous = block.previous;
+  }
+  libc_munmap(block.slots, block.size);
+  block = {};
+}
+
+// Callers hold the lock
+void CallRecorder::Sum(int32_t slot, CallStatistics* stats) {
+  *stats = retired_[slot];
+  auto offset = (static_cast<size_t>(slot) + 1) * sizeof(CallStatistics);
+  for (auto block = blocks_; block; block = block->next) {
+    if (block->size >= offset) Add(*stats, block->slots[slot]);
+  }
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,71 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "rv64hook.h"
+
+namespace rv64hook {
+
+// CallStatistics of timed hooks. Every thread owns a table with one slot per timed function and
+// only that thread writes it, so trampolines update their slot inline without atomics. Readers
+// sum the tables of live threads with what exited threads left behind.
+class CallRecorder {
+ public:
+  static constexpr int32_t kNoSlot = -1;
+
+  // Generated code indexes `slots` by byte offset and calls Record once it is out of range
+  struct Block {
+    CallStatistics* slots;
+    size_t size;
+    Block* previous;
+    Block* next;
+    bool growing;
+  };
+
+  // Slots are never shared by two live hooks, counts left in a reused slot are hidden
+  static int32_t AllocSlot();
+
+  static void FreeSlot(int32_t slot);
+
+  static void Record(uint32_t slot, uint64_t ticks);
+
+  static void Collect(int32_t slot, CallStatistics* stats);
+
+  static void Reset(int32_t slot);
+
+  static bool GetThreadPointerOffset(intptr_t* offset);
+
+ private:
+  static void Grow(Block& block, size_t size);
+
+  static void Retire(void*);
+
+  static void Sum(int32_t slot, CallStatistics* stats);
+};
+
+static_assert(offsetof(CallRecorder::Block, slots) == 0, "Bad Block layout");
+static_assert(offsetof(CallRecorder::Block, size) == 8, "Bad Block layout");
+static_assert(offsetof(CallStatistics, calls) == 0, "Bad CallStatistics layout");
+static_assert(offsetof(CallStatistics, ticks) == 8, "Bad CallStatistics layout");
+static_assert(offsetof(CallStatistics, histogram) == 16, "Bad CallStatistics layout");
+
+}  // namespace rv64hook
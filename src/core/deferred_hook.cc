@@ -0,0 +1,486 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __ANDROID__
+#include <android/dlext.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "arch/common/trampoline.h"
+#include "config.h"
+#include "elf/elf_resolver.h"
+#include "hook_handle.h"
+#include "hook_locker.h"
+#include "logger.h"
+#include "rv64hook_internal.h"
+
+namespace rv64hook {
+
+static constexpr const char* kTag = "Deferred Hook";
+
+struct LoadedModule {
+  uintptr_t base;
+  std::string name;
+  // Lowest and highest address of the PT_LOAD segments
+  uintptr_t begin;
+  uintptr_t end;
+};
+
+class DeferredHookExt : public DeferredHook {
+ public:
+  DeferredHookExt(const char* library,
+                  const char* symbol,
+                  func_t hook,
+                  RegisterHandler pre_handler,
+                  RegisterHandler post_handler,
+                  void* data,
+                  func_t* user_backup_addr,
+                  ContextLevel context)
+      : library_(library),
+        symbol_(symbol),
+        hook_(hook),
+        pre_handler_(pre_handler),
+        post_handler_(post_handler),
+        data_(data),
+        user_backup_addr_(user_backup_addr),
+        context_(context),
+        module_base_(0) {
+    handle_ = nullptr;
+  }
+
+  [[nodiscard]] bool Matches(const LoadedModule& module) const;
+
+  // The module may have been unloaded and another one loaded at the same base since the hook
+  // was applied, its code is then fresh and no longer jumps to the trampoline
+  [[nodiscard]] bool IsAppliedTo(const LoadedModule& module) const {
+    return module.base == module_base_ && module.name == module_name_ &&
+           reinterpret_cast<HookHandleExt*>(handle_)->GetInfo()->IsPatched();
+  }
+
+  [[nodiscard]] const std::string& GetSymbol() const {
+    return symbol_;
+  }
+
+  void Apply(const LoadedModule& module, void* address);
+
+  // The module is already unmapped, only the bookkeeping is released
+  void Forget();
+
+  bool CancelExt();
+
+ private:
+  std::string library_;
+  std::string symbol_;
+  func_t hook_;
+  RegisterHandler pre_handler_;
+  RegisterHandler post_handler_;
+  void* data_;
+  func_t* user_backup_addr_;
+  ContextLevel context_;
+  uintptr_t module_base_;
+  std::string module_name_;
+};
+
+// Registrations and the loader watcher are guarded by their own lock, hooks are installed
+// through the public API so that the usual per-function locking applies
+static pthread_mutex_t deferred_mutex_ = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static std::vector<DeferredHookExt*> deferred_hooks_;
+static bool watcher_installed_ = false;
+static bool rescan_ = false;
+static unsigned long long loaded_adds_ = 0;
+static unsigned long long loaded_subs_ = 0;
+// As of the previous scan, to find what an unload took away
+static std::vector<LoadedModule> loaded_modules_;
+static thread_local bool scanning_ = false;
+
+class DeferredLocker {
+ public:
+  DeferredLocker() {
+    pthread_mutex_lock(&deferred_mutex_);
+  }
+
+  ~DeferredLocker() {
+    pthread_mutex_unlock(&deferred_mutex_);
+  }
+};
+
+bool DeferredHookExt::Matches(const LoadedModule& module) const {
+  return ElfResolver::MatchesLibrary(module.name.c_str(), library_.c_str());
+}
+
+void DeferredHookExt::Apply(const LoadedModule& module, void* address) {
+  if (!address) [[unlikely]] {
+    SET_ERROR("Symbol %s not found in %s", symbol_.c_str(), module.name.c_str());
+    return;
+  }
+
+  ScopedRWXMemory rwx(address, ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+  if (!rwx.IsValid()) [[unlikely]] {
+    SET_ERROR("Function is not writable");
+    return;
+  }
+  if (hook_) {
+    handle_ = InlineHook(address, hook_, user_backup_addr_);
+  } else {
+    handle_ = InlineInstrument(
+        address, pre_handler_, post_handler_, data_, user_backup_addr_, context_);
+  }
+  if (handle_) {
+    module_base_ = module.base;
+    module_name_ = module.name;
+  }
+}
+
+void DeferredHookExt::Forget() {
+  auto address = handle_->GetAddress();
+  {
+    HookLocker locker(address);
+    reinterpret_cast<HookHandleExt*>(handle_)->UnhookExt(false);
+  }
+  handle_ = nullptr;
+  module_base_ = 0;
+  module_name_.clear();
+  if (user_backup_addr_) {
+    *user_backup_addr_ = nullptr;
+  }
+}
+
+bool DeferredHookExt::CancelExt() {
+  DeferredLocker locker;
+  auto it = std::find(deferred_hooks_.begin(), deferred_hooks_.end(), this);
+  if (it == deferred_hooks_.end()) [[unlikely]] {
+    return false;
+  }
+  deferred_hooks_.erase(it);
+
+  auto result = true;
+  if (handle_) {
+    auto address = handle_->GetAddress();
+    ScopedRWXMemory rwx(address, ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+    result = handle_->Unhook();
+  }
+  delete this;
+  return result;
+}
+
+// `unloaded` is set when a module may have gone since the previous call
+static std::vector<LoadedModule> CollectModules(bool* changed, bool* unloaded) {
+  struct Context {
+    std::vector<LoadedModule> modules;
+    unsigned long long adds;
+    unsigned long long subs;
+  } context{{}, 0, 0};
+
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t size, void* data) -> int {
+        auto context = static_cast<Context*>(data);
+        if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+          context->adds = info->dlpi_adds;
+          context->subs = info->dlpi_subs;
+        }
+        if (info->dlpi_name && info->dlpi_name[0]) {
+          LoadedModule module{info->dlpi_addr, info->dlpi_name, UINTPTR_MAX, 0};
+          for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+            auto& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD) continue;
+            module.begin = std::min<uintptr_t>(module.begin, info->dlpi_addr + phdr.p_vaddr);
+            module.end =
+                std::max<uintptr_t>(module.end, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+          }
+          context->modules.push_back(std::move(module));
+        }
+        return 0;
+      },
+      &context);
+
+  *changed = context.adds == 0 || context.adds != loaded_adds_ || context.subs != loaded_subs_;
+  *unloaded = context.adds == 0 || context.subs != loaded_subs_;
+  loaded_adds_ = context.adds;
+  loaded_subs_ = context.subs;
+  return std::move(context.modules);
+}
+
+static void Scan() {
+  if (scanning_) return;
+  scanning_ = true;
+
+  // dl_iterate_phdr may take the loader lock, so it must not run under deferred_mutex_
+  bool changed;
+  bool unloaded;
+  auto modules = CollectModules(&changed, &unloaded);
+  ElfResolver::Refresh();
+
+  struct Pending {
+    DeferredHookExt* hook;
+    const LoadedModule* module;
+    std::string symbol;
+    void* address;
+  };
+  std::vector<Pending> pending;
+  {
+    DeferredLocker locker;
+    if (changed || rescan_) {
+      rescan_ = false;
+      for (auto hook : deferred_hooks_) {
+        if (!hook->GetHandle()) continue;
+        auto loaded = std::any_of(modules.begin(), modules.end(), [hook](auto& module) {
+          return hook->IsAppliedTo(module);
+        });
+        if (!loaded) hook->Forget();
+      }
+      // Any other hook into an unloaded module would point into freed or reused memory
+      if (unloaded) {
+        for (auto& old : loaded_modules_) {
+          auto it = std::find_if(modules.begin(), modules.end(), [&old](auto& module) {
+            return module.base == old.base && module.name == old.name;
+          });
+          HookInfo::ForgetRange(old.begin, old.end, it != modules.end());
+        }
+      }
+      loaded_modules_ = modules;
+      for (auto hook : deferred_hooks_) {
+        if (hook->GetHandle()) continue;
+        for (auto& module : modules) {
+          if (!hook->Matches(module)) continue;
+          pending.push_back({hook, &module, hook->GetSymbol(), nullptr});
+          break;
+        }
+      }
+    }
+  }
+
+  // Resolving an IFUNC enters the loader, so symbols are looked up without the lock. Hooks
+  // cancelled or applied in the meantime are skipped
+  for (auto& entry : pending) {
+    auto& module = *entry.module;
+    entry.address = ElfResolver::FindSymbol(module.base, module.name.c_str(), entry.symbol.c_str());
+  }
+  if (!pending.empty()) {
+    DeferredLocker locker;
+    for (auto& entry : pending) {
+      auto it = std::find(deferred_hooks_.begin(), deferred_hooks_.end(), entry.hook);
+      if (it == deferred_hooks_.end() || entry.hook->GetHandle() ||
+          entry.hook->GetSymbol() != entry.symbol || !entry.hook->Matches(*entry.module)) {
+        continue;
+      }
+      entry.hook->Apply(*entry.module, entry.address);
+    }
+  }
+
+  scanning_ = false;
+}
+
+static void OnLoaderEvent(RegisterContext*, HookHandle*, void*) {
+  Scan();
+}
+
+// The loader functions instrumented at most
+static constexpr size_t kMaxWatchedFunctions = 3;
+
+static bool InstrumentAll(const func_t* functions,
+                          size_t count,
+                          RegisterHandler pre_handler,
+                          RegisterHandler post_handler) {
+  HookHandle* handles[kMaxWatchedFunctions]{};
+  for (size_t i = 0; i < count; ++i) {
+    if (!functions[i]) continue;
+    ScopedRWXMemory rwx(functions[i], ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+    handles[i] = InlineInstrument(functions[i],
+                                  pre_handler,
+                                  post_handler,
+                                  nullptr,
+                                  nullptr,
+                                  ContextLevel::kIntegerArguments);
+    if (!handles[i]) [[unlikely]] {
+      for (size_t j = 0; j < i; ++j) {
+        if (!handles[j]) continue;
+        ScopedRWXMemory unused(functions[j], ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+        handles[j]->Unhook();
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifndef __ANDROID__
+// Scans for the loader, which calls r_brk with its lock held
+static pthread_mutex_t watcher_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watcher_cond_ = PTHREAD_COND_INITIALIZER;
+static bool loader_changed_ = false;
+static pid_t watcher_pid_ = 0;
+
+static void* WatchLoader(void*) {
+  for (;;) {
+    pthread_mutex_lock(&watcher_mutex_);
+    while (!loader_changed_) pthread_cond_wait(&watcher_cond_, &watcher_mutex_);
+    loader_changed_ = false;
+    pthread_mutex_unlock(&watcher_mutex_);
+
+    // dladdr takes the loader lock, which the dlopen or dlclose that signalled keeps until its
+    // initializers or finalizers have run
+    Dl_info info;
+    dladdr(reinterpret_cast<void*>(&WatchLoader), &info);
+    Scan();
+  }
+  return nullptr;
+}
+
+static void OnDebugState(RegisterContext*, HookHandle*, void*) {
+  if (__atomic_load_n(&_r_debug.r_state, __ATOMIC_ACQUIRE) != r_debug::RT_CONSISTENT) return;
+
+  pthread_mutex_lock(&watcher_mutex_);
+  loader_changed_ = true;
+  // Started on first use, and again in a forked child, which has no copy of the thread
+  auto pid = getpid();
+  if (watcher_pid_ != pid) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, WatchLoader, nullptr) == 0) [[likely]] {
+      pthread_detach(thread);
+      watcher_pid_ = pid;
+    } else {
+      SET_ERROR("Failed to start the loader watcher");
+    }
+  }
+  pthread_cond_signal(&watcher_cond_);
+  pthread_mutex_unlock(&watcher_mutex_);
+}
+
+// _dl_debug_state is empty, the jump to the trampoline has to fit into its return and the
+// alignment padding after it. c.nop, nop and zeros are taken as padding
+static bool HasRoomForHook(func_t function) {
+  Dl_info info;
+  void* extra = nullptr;
+  if (!dladdr1(function, &info, &extra, RTLD_DL_SYMENT) || !extra) return false;
+  auto symbol = static_cast<const ElfW(Sym)*>(extra);
+  // The wide jump may start with two bytes of alignment
+  auto needed = Trampoline::GetFirstTrampolineSize(TrampolineType::kWide) + sizeof(uint16_t);
+  auto code = static_cast<const uint16_t*>(function);
+  for (auto i = symbol->st_size / sizeof(uint16_t); i * sizeof(uint16_t) < needed; ++i) {
+    if (code[i] == 0x0013 && code[i + 1] == 0x0000) {
+      ++i;
+    } else if (code[i] != 0x0001 && code[i] != 0x0000) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+static bool InstallWatcher() {
+#ifdef __ANDROID__
+  // The linker entry points take the caller address as an argument, hooking them keeps
+  // namespace resolution intact, unlike hooking dlopen in libdl
+  const char* symbols[] = {"__loader_dlopen", "__loader_android_dlopen_ext", "__loader_dlclose"};
+  func_t functions[std::size(symbols)]{};
+  for (size_t i = 0; i < std::size(symbols); ++i) {
+    functions[i] = dlsym(RTLD_DEFAULT, symbols[i]);
+  }
+  if (!functions[0] || !functions[2]) {
+    functions[0] = reinterpret_cast<func_t>(dlopen);
+    functions[1] = reinterpret_cast<func_t>(android_dlopen_ext);
+    functions[2] = reinterpret_cast<func_t>(dlclose);
+  }
+#else
+  // r_brk is what debuggers watch, the loader calls it around every change of the link map.
+  // Instrumenting it leaves dlopen's view of its caller, and so $ORIGIN, RUNPATH and the
+  // namespace, untouched
+  auto debug_state = reinterpret_cast<func_t>(_r_debug.r_brk);
+  if (debug_state && HasRoomForHook(debug_state) &&
+      InstrumentAll(&debug_state, 1, OnDebugState, nullptr)) {
+    return true;
+  }
+  // Without room in r_brk. dlopen then sees the trampoline as its caller, so $ORIGIN and
+  // RUNPATH of the real caller are not applied to libraries loaded with a relative path
+  func_t functions[] = {reinterpret_cast<func_t>(dlopen), reinterpret_cast<func_t>(dlclose)};
+#endif
+  return InstrumentAll(functions, std::size(functions), nullptr, OnLoaderEvent);
+}
+
+static DeferredHook* Register(DeferredHookExt* hook) {
+  {
+    DeferredLocker locker;
+    if (!watcher_installed_) {
+      if (!InstallWatcher()) [[unlikely]] {
+        delete hook;
+        return nullptr;
+      }
+      watcher_installed_ = true;
+    }
+    deferred_hooks_.push_back(hook);
+    rescan_ = true;
+  }
+  Scan();
+  return hook;
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool DeferredHook::Cancel() {
+  ClearError();
+  return reinterpret_cast<DeferredHookExt*>(this)->CancelExt();
+}
+
+[[gnu::visibility("default"), maybe_unused]] DeferredHook* InlineHookDeferred(
+    const char* library, const char* symbol, func_t hook, func_t* backup) {
+  if (!library || !symbol || !hook) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return nullptr;
+  }
+  ClearError();
+  return Register(new DeferredHookExt(
+      library, symbol, hook, nullptr, nullptr, nullptr, backup, ContextLevel::kFull));
+}
+
+[[gnu::visibility("default"), maybe_unused]] DeferredHook* InlineInstrumentDeferred(
+    const char* library,
+    const char* symbol,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup) {
+  return InlineInstrumentDeferred(
+      library, symbol, pre_handler, post_handler, data, backup, ContextLevel::kFull);
+}
+
+[[gnu::visibility("default"), maybe_unused]] DeferredHook* InlineInstrumentDeferred(
+    const char* library,
+    const char* symbol,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup,
+    ContextLevel context) {
+  if (!library || !symbol || (!pre_handler && !post_handler)) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return nullptr;
+  }
+  ClearError();
+  return Register(new DeferredHookExt(
+      library, symbol, nullptr, pre_handler, post_handler, data, backup, context));
+}
+
+}  // namespace rv64hook
@@ -20,6 +20,7 @@
 
 #include "arch/common/instruction_relocator.h"
 #include "arch/common/trampoline.h"
+#include "icache.h"
 #include "logger.h"
 #include "memory.h"
 
@@ -72,6 +73,7 @@ int FunctionRecord::WriteTrampoline(func_t hook, func_t* backup) {
 
 void FunctionRecord::Unhook() {
   Memory::Copy(address_, function_backup_, overwrite_size_);
+  ICache::Invalidate(address_, overwrite_size_);
   if (backup_trampoline_) {
     Memory::Free(backup_trampoline_);
   }
@@ -0,0 +1,38 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "handler_table.h"
+
+#include <new>
+
+namespace rv64hook {
+
+HandlerTable* HandlerTable::New(uint32_t capacity) {
+  auto memory = ::operator new(sizeof(HandlerTable) + capacity * sizeof(Entry),
+                               std::align_val_t{alignof(HandlerTable)});
+  auto table = new (memory) HandlerTable;
+  table->count = 0;
+  table->capacity = capacity;
+  return table;
+}
+
+void HandlerTable::Delete(HandlerTable* table) {
+  ::operator delete(table, std::align_val_t{alignof(HandlerTable)});
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,66 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "arch/common/handle_offset.h"
+#include "rv64hook.h"
+
+namespace rv64hook {
+
+// The pre and post handlers of one hooked function in a cache-line-aligned array, which the
+// generic trampoline walks instead of the handle list. Entries are appended, removing one
+// publishes a copy without it, a disabled handle keeps its entry with the handlers cleared
+struct alignas(64) HandlerTable {
+  struct Entry {
+    HookHandle* handle;
+    RegisterHandler pre_handler;
+    RegisterHandler post_handler;
+    void* data;
+  };
+
+  static constexpr uint32_t kNoIndex = UINT32_MAX;
+  static constexpr uint32_t kInitialCapacity = 4;
+
+  uint32_t count;
+  uint32_t capacity;
+
+  [[nodiscard]] Entry* GetEntries() {
+    return reinterpret_cast<Entry*>(this + 1);
+  }
+
+  // Empty, with room for `capacity` entries after the header
+  static HandlerTable* New(uint32_t capacity);
+
+  static void Delete(HandlerTable* table);
+};
+
+static_assert(offsetof(HandlerTable, count) == HandlerTable_count, "Bad HandlerTable layout");
+static_assert(sizeof(HandlerTable) == HandlerTable_entries, "Bad HandlerTable layout");
+static_assert(sizeof(HandlerTable::Entry) == 1 << HandlerEntry_shift, "Bad Entry layout");
+static_assert(offsetof(HandlerTable::Entry, handle) == HandlerEntry_handle, "Bad Entry layout");
+static_assert(offsetof(HandlerTable::Entry, pre_handler) == HandlerEntry_pre_handler,
+              "Bad Entry layout");
+static_assert(offsetof(HandlerTable::Entry, post_handler) == HandlerEntry_post_handler,
+              "Bad Entry layout");
+static_assert(offsetof(HandlerTable::Entry, data) == HandlerEntry_data, "Bad Entry layout");
+
+}  // namespace rv64hook
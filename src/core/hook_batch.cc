@@ -0,0 +1,306 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "arch/common/trampoline.h"
+#include "config.h"
+#include "elf/elf_resolver.h"
+#include "hook_handle.h"
+#include "hook_locker.h"
+#include "icache.h"
+#include "logger.h"
+#include "parallel_for.h"
+#include "profiler.h"
+#include "relocation_cache.h"
+#include "rv64hook_internal.h"
+
+namespace rv64hook {
+
+static constexpr const char* kTag = "Hook";
+
+// Below this many new functions per worker, waking threads costs more than relocating
+static constexpr size_t kMinHooksPerWorker = 32;
+
+struct HookRequest {
+  func_t address;
+  func_t hook;
+  RegisterHandler pre_handler;
+  RegisterHandler post_handler;
+  void* data;
+  func_t* backup;
+  ContextLevel context;
+};
+
+struct PendingSite {
+  HookInfo* info;
+  TrampolineType type;
+  bool written;
+};
+
+// Makes the pages of every pending site writable, one mprotect per run of adjacent pages
+class ScopedWritableSites {
+ public:
+  ScopedWritableSites(const std::vector<PendingSite>& sites, int original_prot)
+      : prot_(original_prot), valid_(true) {
+    auto page_size = static_cast<uintptr_t>(getpagesize());
+    std::vector<std::pair<uintptr_t, uintptr_t>> pages;
+    pages.reserve(sites.size());
+    for (auto& site : sites) {
+      auto address = reinterpret_cast<uintptr_t>(site.info->address);
+      pages.emplace_back(__builtin_align_down(address, page_size),
+                         __builtin_align_up(address + kMaxFirstTrampolineSize, page_size));
+    }
+    std::sort(pages.begin(), pages.end());
+
+    for (auto& page : pages) {
+      if (!ranges_.empty() && page.first <= ranges_.back().second) {
+        ranges_.back().second = std::max(ranges_.back().second, page.second);
+      } else {
+        ranges_.push_back(page);
+      }
+    }
+
+    for (auto it = ranges_.begin(); it != ranges_.end(); ++it) {
+      if (mprotect(reinterpret_cast<void*>(it->first),
+                   it->second - it->first,
+                   PROT_READ | PROT_WRITE | PROT_EXEC) != 0) [[unlikely]] {
+        ranges_.erase(it, ranges_.end());
+        valid_ = false;
+        break;
+      }
+    }
+  }
+
+  ~ScopedWritableSites() {
+    for (auto& range : ranges_) {
+      mprotect(reinterpret_cast<void*>(range.first), range.second - range.first, prot_);
+    }
+  }
+
+  [[nodiscard]] bool IsValid() const {
+    return valid_;
+  }
+
+ private:
+  std::vector<std::pair<uintptr_t, uintptr_t>> ranges_;
+  int prot_;
+  bool valid_;
+};
+
+static std::vector<HookRequest>& GetRequests(void* requests) {
+  return *static_cast<std::vector<HookRequest>*>(requests);
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookBatch::HookBatch(int original_prot)
+    : requests_(new std::vector<HookRequest>), prot_(original_prot) {
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookBatch::~HookBatch() {
+  delete &GetRequests(requests_);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookBatch::InlineHook(func_t address,
+                                                                        func_t hook,
+                                                                        func_t* backup) {
+  if (!address || !hook) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  GetRequests(requests_).push_back(
+      {address, hook, nullptr, nullptr, nullptr, backup, ContextLevel::kFull});
+  return true;
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookBatch::InlineInstrument(
+    func_t address,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup) {
+  return InlineInstrument(address, pre_handler, post_handler, data, backup, ContextLevel::kFull);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookBatch::InlineInstrument(
+    func_t address,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup,
+    ContextLevel context) {
+  if (!address || (!pre_handler && !post_handler)) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  if (!USE_VECTOR_EXTENSION && context == ContextLevel::kVector) [[unlikely]] {
+    SET_ERROR("Built without the vector extension");
+    return false;
+  }
+  GetRequests(requests_).push_back(
+      {address, nullptr, pre_handler, post_handler, data, backup, context});
+  return true;
+}
+
+[[gnu::visibility("default"), maybe_unused]] size_t HookBatch::Size() const {
+  return GetRequests(requests_).size();
+}
+
+[[gnu::visibility("default"), maybe_unused]] void HookBatch::Clear() {
+  GetRequests(requests_).clear();
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookBatch::Commit(HookHandle** handles) {
+  auto& requests = GetRequests(requests_);
+  if (requests.empty()) [[unlikely]] {
+    return true;
+  }
+
+  // Modules loaded since the last refresh would miss the cache, the loader must not be
+  // entered once the hook locks are held
+  if (RelocationCache::IsEnabled()) {
+    ElfResolver::Refresh();
+  }
+
+  std::vector<const void*> addresses;
+  addresses.reserve(requests.size());
+  for (auto& r : requests) {
+    addresses.push_back(r.address);
+  }
+  HookLocker locker(addresses.data(), addresses.size());
+  ClearError();
+  ScopedICacheSync icache;
+
+  // Functions hooked for the first time, each gets one second trampoline even if it is
+  // requested several times
+  std::vector<PreparedHook> prepared;
+  std::unordered_map<func_t, size_t> prepared_index;
+  std::vector<PendingSite> sites;
+  // Every staged handle and the index of the site it created, or -1
+  std::vector<std::pair<HookHandleExt*, int>> installed;
+  installed.reserve(requests.size());
+
+  auto rollback = [&]() {
+    for (auto it = installed.rbegin(); it != installed.rend(); ++it) {
+      auto [handle, site] = *it;
+      handle->UnhookExt(site < 0 || sites[site].written);
+    }
+    for (auto& hook : prepared) {
+      if (hook.trampoline) DiscardHook(&hook);
+    }
+    requests.clear();
+    return false;
+  };
+
+  for (auto& r : requests) {
+    if (HookInfo::Lookup(r.address) || prepared_index.contains(r.address)) continue;
+    prepared_index.emplace(r.address, prepared.size());
+    auto& hook = prepared.emplace_back();
+    hook.address = r.address;
+    if (!AllocHookTrampoline(&hook)) [[unlikely]] {
+      prepared.pop_back();
+      return rollback();
+    }
+  }
+
+  // Decoding and assembling dominate install time and only touch private buffers, so they run
+  // in parallel. Everything that publishes state below stays serialized under the hook locks.
+  std::vector<uint8_t> relocated(prepared.size());
+  ParallelFor(prepared.size(), kMinHooksPerWorker, [&](size_t i) {
+    relocated[i] = RelocateHook(&prepared[i]);
+  });
+  for (size_t i = 0; i < prepared.size(); ++i) {
+    if (!relocated[i]) [[unlikely]] {
+      // Errors are thread-local, redo the failure here so the caller can see why
+      RelocateHook(&prepared[i]);
+      return rollback();
+    }
+  }
+
+  for (auto& r : requests) {
+    HookInfo* info;
+    int site = -1;
+    if (auto it = prepared_index.find(r.address); it != prepared_index.end()) {
+      auto& hook = prepared[it->second];
+      info = CommitHook(&hook);
+      if (!info) [[unlikely]] {
+        return rollback();
+      }
+      site = static_cast<int>(sites.size());
+      sites.push_back({info, hook.type, false});
+      prepared_index.erase(it);
+    } else {
+      bool created;
+      TrampolineType type;
+      info = PrepareHookInfo(r.address, &created, &type);
+      if (!info) [[unlikely]] {
+        return rollback();
+      }
+    }
+    auto handle = info->NewHookHandle(
+        r.hook, r.pre_handler, r.post_handler, r.data, r.backup, r.context, nullptr);
+    if (!handle) [[unlikely]] {
+      // A HookInfo created above was released with the handle
+      if (site >= 0) sites.pop_back();
+      return rollback();
+    }
+    installed.emplace_back(handle, site);
+  }
+
+  {
+    ScopedPhaseTimer timer(InstallPhase::kFlushICache);
+    // The trampolines must be visible before any jump to them is
+    ICache::Sync();
+  }
+
+  if (!sites.empty()) {
+    ScopedWritableSites unused(sites, prot_);
+    if (!unused.IsValid()) [[unlikely]] {
+      SET_ERROR("Function is not writable");
+      return rollback();
+    }
+    ScopedPhaseTimer timer(InstallPhase::kWriteFirstTrampoline);
+    for (auto& site : sites) {
+      if (!Trampoline::WriteFirstTrampoline(site.info->address, site.info->trampoline, site.type))
+          [[unlikely]] {
+        SET_ERROR("Function is not writable");
+        return rollback();
+      }
+      site.written = true;
+    }
+  }
+  {
+    ScopedPhaseTimer timer(InstallPhase::kFlushICache);
+    ICache::Sync();
+  }
+  Profiler::CountInstall(sites.size());
+
+  if (handles) {
+    for (size_t i = 0; i < installed.size(); ++i) {
+      handles[i] = installed[i].first;
+    }
+  }
+  requests.clear();
+  return true;
+}
+
+}  // namespace rv64hook
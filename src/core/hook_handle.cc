@@ -18,20 +18,59 @@
 
 #include "hook_handle.h"
 
+#include <algorithm>
 #include <cstring>
 
+#include "call_recorder.h"
 #include "config.h"
 #include "hook_locker.h"
+#include "icache.h"
 #include "logger.h"
 #include "memory.h"
+#include "profiler.h"
+#include "reentrancy_guard.h"
+#include "shadow_stack.h"
+#include "thread_filter.h"
 
 namespace rv64hook {
 
-std::map<func_t, HookInfo*> HookInfo::hooks_;
+static constexpr const char* kTag = "Hook";
+// Generated second trampolines per hook that call their handlers directly
+static constexpr size_t kMaxDirectTrampolines = 8;
+
+constinit AddressIndex<HookInfo> HookInfo::hooks_;
+
+// Every handler of the list gets at least what it asked for
+static ContextLevel MergeContextLevel(ContextLevel a, ContextLevel b) {
+  if (a == ContextLevel::kVector || b == ContextLevel::kVector) return ContextLevel::kVector;
+  // The others are ordered from most to least saved
+  return std::min(a, b);
+}
 
 HookInfo* HookInfo::Lookup(func_t func) {
-  auto p = hooks_.find(func);
-  return p != hooks_.end() ? p->second : nullptr;
+  return hooks_.Find(func);
+}
+
+void HookInfo::ForgetRange(uintptr_t begin, uintptr_t end, bool remapped) {
+  std::vector<func_t> addresses;
+  hooks_.ForEach([&](HookInfo* info) {
+    auto address = reinterpret_cast<uintptr_t>(info->address);
+    if (address >= begin && address < end) addresses.push_back(info->address);
+  });
+  for (auto address : addresses) {
+    HookLocker locker(address);
+    auto info = Lookup(address);
+    if (!info || (remapped && info->IsPatched())) continue;
+    info->root_handle->UnhookAllExt(false);
+  }
+}
+
+bool HookInfo::IsPatched() const {
+  return memcmp(address, function_backup, function_backup_size) != 0;
+}
+
+size_t HookInfo::Count() {
+  return hooks_.Size();
 }
 
 HookInfo* HookInfo::Create(func_t address,
@@ -42,6 +81,8 @@ HookInfo* HookInfo::Create(func_t address,
   auto info = new HookInfo;
   info->address = address;
   info->root_handle = nullptr;
+  info->last_handle = nullptr;
+  info->handlers = nullptr;
   info->trampoline = trampoline;
   if (is_user_alloc) {
     auto ta = GetTrampolineAllocator();
@@ -53,8 +94,20 @@ HookInfo* HookInfo::Create(func_t address,
   info->relocated = relocated;
   info->handle_count = 0;
   info->function_backup_size = function_backup_size;
+  info->trampoline_entry = nullptr;
+  info->stats_slot = CallRecorder::kNoSlot;
+  info->stats_enabled = false;
+  info->sampled = false;
+  info->sampler = nullptr;
+  info->sampling_mode = SamplingMode::kEveryNth;
+  info->thread_filter = ThreadFilter::kNone;
+  info->enabled_by_default = true;
+  info->reentrancy_group = ReentrancyGuard::kNone;
   Memory::Copy(info->function_backup, address, function_backup_size);
-  hooks_.emplace(address, info);
+  if (!hooks_.Insert(address, info)) [[unlikely]] {
+    delete info;
+    return nullptr;
+  }
   return info;
 }
 
@@ -62,27 +115,38 @@ HookHandleExt* HookInfo::NewHookHandle(func_t hook,
                                        RegisterHandler pre_handler,
                                        RegisterHandler post_handler,
                                        void* data,
-                                       func_t* user_backup_addr) {
+                                       func_t* user_backup_addr,
+                                       ContextLevel context,
+                                       ProbeHandler probe) {
+  auto new_handle = new HookHandleExt(
+      this, address, hook, pre_handler, post_handler, data, user_backup_addr, context, probe);
+  if (!AddHookHandle(new_handle)) [[unlikely]] {
+    if (user_backup_addr) *user_backup_addr = nullptr;
+    // Also releases this HookInfo if the handle was its first
+    new_handle->UnhookExt(false);
+    return nullptr;
+  }
+  return new_handle;
+}
+
+bool HookInfo::AddHookHandle(HookHandleExt* new_handle) {
   ScopedWritableAllocatedMemory unused(custom_free ? nullptr : trampoline);
 
   auto td = GetTrampolineData();
-  auto new_handle =
-      new HookHandleExt(this, address, hook, pre_handler, post_handler, data, user_backup_addr);
+  auto hook = new_handle->hook_;
+  auto pre_handler = new_handle->pre_handler_;
+  auto post_handler = new_handle->post_handler_;
+  auto user_backup_addr = new_handle->user_backup_addr_;
 
   handle_count++;
 
   if (root_handle) {
-    auto backup = relocated;
-    for (auto handle = root_handle; handle; handle = handle->next_) {
-      if (handle->hook_) {
-        backup = handle->hook_;
-      }
-      if (!handle->next_) {
-        handle->next_ = new_handle;
-        new_handle->previous_ = handle;
-        break;
-      }
-    }
+    // The last hook in the list, which the last handle either is or calls
+    auto last = last_handle;
+    auto backup = last->hook_ ? last->hook_ : last->backup_;
+    last->next_ = new_handle;
+    new_handle->previous_ = last;
+    last_handle = new_handle;
 
     new_handle->backup_ = backup;
 
@@ -100,14 +164,9 @@ HookHandleExt* HookInfo::NewHookHandle(func_t hook,
     }
   } else {
     root_handle = new_handle;
-    td->root_handle = new_handle;
+    last_handle = new_handle;
     new_handle->backup_ = relocated;
 
-    if (STORE_RETURN_ADDRESS_BY_TLS && pthread_key_create(&td->tls_key, nullptr) == 0) {
-      td->getspecific = pthread_getspecific;
-      td->setspecific = pthread_setspecific;
-    }
-
     if (user_backup_addr) {
       *user_backup_addr = relocated;
     }
@@ -122,31 +181,280 @@ HookHandleExt* HookInfo::NewHookHandle(func_t hook,
     td->enabled = true;
   }
 
-  return new_handle;
+  if (pre_handler || post_handler) new_handle->handler_index_ = AddHandlers(new_handle);
+
+  return UpdateTrampoline(new_handle != root_handle);
 }
 
 TrampolineData* HookInfo::GetTrampolineData() const {
   return Trampoline::GetTrampolineData(trampoline);
 }
 
+// The generic code never filters, samples, guards or times calls, and always saves the full
+// context, in a frame that keeps the TrampolineData where RegisterContext::vector_ lives. Handlers
+// that asked for a smaller frame or are probes would pay for all of it
+static bool NeedsSpecializedCode(const TrampolineShape& shape) {
+  if (shape.stats_slot != CallRecorder::kNoSlot || shape.thread_filter != ThreadFilter::kNone ||
+      shape.sampled || shape.reentrancy_group != ReentrancyGuard::kNone) {
+    return true;
+  }
+  if (shape.pre_handlers.empty() && shape.post_handlers.empty()) return false;
+  return shape.context != ContextLevel::kFull ||
+         std::any_of(shape.pre_handlers.begin(),
+                     shape.pre_handlers.end(),
+                     [](const HandlerCall& handler) { return handler.probe; });
+}
+
+TrampolineShape HookInfo::GetShape(bool replace, const HookHandleExt* removed) const {
+  TrampolineShape shape{replace,
+                        {},
+                        {},
+                        ContextLevel::kFull,
+                        stats_enabled ? stats_slot : CallRecorder::kNoSlot,
+                        thread_filter,
+                        enabled_by_default,
+                        false,
+                        sampling_mode,
+                        nullptr,
+                        ReentrancyGuard::kNone,
+                        false,
+                        false,
+                        false};
+  if (shape.replace) {
+    // Timing a replacement gives no handler a context to read
+    if (shape.stats_slot != CallRecorder::kNoSlot) shape.context = ContextLevel::kIntegerArguments;
+  } else {
+    shape.context = ContextLevel::kIntegerArguments;
+    auto entries = handlers ? handlers->GetEntries() : nullptr;
+    auto removed_index = removed ? removed->handler_index_ : HandlerTable::kNoIndex;
+    // In table order, like the generic code
+    for (uint32_t i = 0; handlers && i < handlers->count; ++i) {
+      if (i == removed_index) continue;
+      auto& [handle, pre_handler, post_handler, data] = entries[i];
+      if (!pre_handler && !post_handler) continue;
+      auto ext = static_cast<HookHandleExt*>(handle);
+      if (pre_handler) shape.pre_handlers.push_back({pre_handler, handle, data, ext->probe_});
+      if (post_handler) shape.post_handlers.push_back({post_handler, handle, data, nullptr});
+      shape.context = MergeContextLevel(shape.context, ext->context_);
+    }
+    // A replacement runs on every call
+    shape.sampled = sampled;
+    if (sampled) shape.sampler = sampler;
+    if (!shape.pre_handlers.empty() || !shape.post_handlers.empty()) {
+      shape.reentrancy_group = reentrancy_group;
+    }
+  }
+  return shape;
+}
+
+bool HookInfo::GetTrampolineCode(TrampolineShape shape, bool published, void** code) {
+  // Replacements and plain handler lists stay on the shared generic code, which costs them no
+  // executable memory of their own
+  *code = nullptr;
+  if (!NeedsSpecializedCode(shape)) return true;
+
+  auto find = [this](const TrampolineShape& wanted) -> void* {
+    for (auto& [generated_shape, generated] : generated_trampolines) {
+      if (generated_shape == wanted) return generated;
+    }
+    return nullptr;
+  };
+  *code = find(shape);
+  // Every new handle or data, and every combination of enabled handles, is a new shape. Past
+  // a few, the handlers are read from the table so that churn keeps reusing the same code
+  if (!*code && generated_trampolines.size() >= kMaxDirectTrampolines &&
+      (!shape.pre_handlers.empty() || !shape.post_handlers.empty())) {
+    shape.table_handlers = true;
+    shape.has_pre_handlers = !shape.pre_handlers.empty();
+    shape.has_post_handlers = !shape.post_handlers.empty();
+    shape.pre_handlers.clear();
+    shape.post_handlers.clear();
+    // A handle added later is called by this code before the shape catches up with it
+    shape.context = MergeContextLevel(shape.context, ContextLevel::kFull);
+    *code = find(shape);
+  }
+  // The entry can only be patched into a jump in an aligned trampoline
+  if (!*code && reinterpret_cast<uintptr_t>(trampoline) % sizeof(uint32_t) == 0) {
+    ScopedPhaseTimer timer(InstallPhase::kAllocSecondTrampoline);
+    *code = Trampoline::GenerateSecondTrampoline(trampoline, shape);
+    if (*code) [[likely]] {
+      generated_trampolines.emplace_back(shape, *code);
+      // The code must be visible before the jump to it is
+      if (published) ICache::Sync();
+    }
+  }
+  if (!*code) [[unlikely]] {
+    SET_ERROR("Failed to generate a specialized trampoline");
+    return false;
+  }
+  return true;
+}
+
+void HookInfo::SetTrampolineEntry(void* code) {
+  if (code == trampoline_entry) return;
+  ScopedWritableAllocatedMemory unused(custom_free ? nullptr : trampoline);
+  Trampoline::SetSecondTrampolineEntry(trampoline, code);
+  trampoline_entry = code;
+}
+
+bool HookInfo::UpdateTrampoline(bool published) {
+  void* code;
+  if (!GetTrampolineCode(GetShape(GetTrampolineData()->hook != nullptr), published, &code)) {
+    return false;
+  }
+  SetTrampolineEntry(code);
+  return true;
+}
+
 void HookInfo::Unhook(bool initialized) {
   if (initialized) {
     Memory::Copy(address, function_backup, function_backup_size);
-    __builtin___clear_cache(static_cast<char*>(address),
-                            static_cast<char*>(address) + function_backup_size);
-  }
-
-  if (auto td = GetTrampolineData(); td->getspecific) {
-    pthread_key_delete(td->tls_key);
+    // Before the trampoline can be handed out again
+    ICache::Invalidate(address, function_backup_size);
+    ICache::Sync();
   }
 
+  delete sampler;
   if (custom_free) {
     custom_free(trampoline, custom_data);
   } else {
-    Memory::Free(trampoline);
+    Trampoline::FreeSecondTrampoline(trampoline);
+  }
+  for (auto& [shape, generated] : generated_trampolines) {
+    Memory::Free(generated);
   }
   Memory::Free(relocated);
-  hooks_.erase(this);
+  if (handlers) HandlerTable::Delete(handlers);
+  for (auto table : retired_handlers) {
+    HandlerTable::Delete(table);
+  }
+  if (stats_slot != CallRecorder::kNoSlot) CallRecorder::FreeSlot(stats_slot);
+  if (thread_filter != ThreadFilter::kNone) ThreadFilter::FreeIndex(thread_filter);
+  hooks_.Erase(address);
+  delete this;
+}
+
+// Grows by doubling. Threads walking the old table move to the new one at their next entry, and
+// both hold the same entries at the same indices
+uint32_t HookInfo::AddHandlers(HookHandleExt* handle) {
+  if (!handlers || handlers->count == handlers->capacity) {
+    auto table =
+        HandlerTable::New(handlers ? handlers->capacity * 2 : HandlerTable::kInitialCapacity);
+    if (handlers) {
+      std::copy_n(handlers->GetEntries(), handlers->count, table->GetEntries());
+      table->count = handlers->count;
+      retired_handlers.push_back(handlers);
+    }
+    handlers = table;
+    __atomic_store_n(&GetTrampolineData()->handlers, table, __ATOMIC_RELEASE);
+  }
+
+  auto index = handlers->count;
+  handlers->GetEntries()[index].handle = handle;
+  UpdateHandlers(index);
+  __atomic_store_n(&handlers->count, index + 1, __ATOMIC_RELEASE);
+  return index;
+}
+
+// Disabled handles keep their entry, only without handlers
+void HookInfo::UpdateHandlers(uint32_t index) {
+  auto& entry = handlers->GetEntries()[index];
+  auto handle = static_cast<HookHandleExt*>(entry.handle);
+  auto enabled = handle->enabled_;
+  __atomic_store_n(&entry.data, handle->data_, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry.pre_handler, enabled ? handle->pre_handler_ : nullptr, __ATOMIC_RELAXED);
+  __atomic_store_n(
+      &entry.post_handler, enabled ? handle->post_handler_ : nullptr, __ATOMIC_RELAXED);
+}
+
+// Readers load an entry's words one by one, so entries are never rewritten in place. The rest
+// are copied in order into a new table that replaces this one, as when the table grows
+void HookInfo::RemoveHandlers(uint32_t index) {
+  auto table = HandlerTable::New(handlers->capacity);
+  auto entries = handlers->GetEntries();
+  auto new_entries = table->GetEntries();
+  std::copy_n(entries, index, new_entries);
+  std::copy(entries + index + 1, entries + handlers->count, new_entries + index);
+  table->count = handlers->count - 1;
+  for (auto i = index; i < table->count; ++i) {
+    static_cast<HookHandleExt*>(new_entries[i].handle)->handler_index_ = i;
+  }
+  retired_handlers.push_back(handlers);
+  handlers = table;
+  __atomic_store_n(&GetTrampolineData()->handlers, table, __ATOMIC_RELEASE);
+}
+
+// Timing needs the specialized code, the generic trampoline does not count calls
+bool HookInfo::SetCallStatisticsEnabled(bool enabled) {
+  if (enabled && !STORE_RETURN_ADDRESS_BY_TLS) [[unlikely]] {
+    SET_ERROR("Built without a shadow stack");
+    return false;
+  }
+  if (enabled && stats_slot == CallRecorder::kNoSlot) {
+    stats_slot = CallRecorder::AllocSlot();
+  }
+  auto old_enabled = stats_enabled;
+  stats_enabled = enabled;
+  if (!UpdateTrampoline(true)) [[unlikely]] {
+    stats_enabled = old_enabled;
+    return false;
+  }
+  return true;
+}
+
+// Like timing, the check is only made by the specialized code
+bool HookInfo::SetSampling(uint32_t rate, SamplingMode mode) {
+  if (!sampler) sampler = Sampler::NewState();
+  Sampler::SetRate(sampler, rate);
+
+  auto old_sampled = sampled;
+  auto old_mode = sampling_mode;
+  sampled = rate > 1;
+  sampling_mode = mode;
+  if (!UpdateTrampoline(true)) [[unlikely]] {
+    sampled = old_sampled;
+    sampling_mode = old_mode;
+    return false;
+  }
+  return true;
+}
+
+bool HookInfo::SetThreadFilter(bool enabled, bool current_thread) {
+  if (thread_filter == ThreadFilter::kNone) {
+    auto index = ThreadFilter::AllocIndex();
+    if (index == ThreadFilter::kNone) [[unlikely]] {
+      SET_ERROR("Too many functions enabled per thread");
+      return false;
+    }
+    thread_filter = index;
+    if (!UpdateTrampoline(true)) [[unlikely]] {
+      ThreadFilter::FreeIndex(thread_filter);
+      thread_filter = ThreadFilter::kNone;
+      return false;
+    }
+  }
+
+  if (current_thread) {
+    ThreadFilter::SetEnabledForCurrentThread(thread_filter, enabled);
+  } else if (enabled != enabled_by_default) {
+    enabled_by_default = enabled;
+    if (!UpdateTrampoline(true)) [[unlikely]] {
+      enabled_by_default = !enabled;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Like timing, the guard is only kept by the specialized code
+bool HookInfo::SetReentrancyGuard(int8_t group) {
+  auto old_group = reentrancy_group;
+  reentrancy_group = group;
+  if (!UpdateTrampoline(true)) [[unlikely]] {
+    reentrancy_group = old_group;
+    return false;
+  }
+  return true;
 }
 
 HookHandleExt::HookHandleExt(HookInfo* info,
@@ -155,7 +463,9 @@ HookHandleExt::HookHandleExt(HookInfo* info,
                              RegisterHandler pre_handler,
                              RegisterHandler post_handler,
                              void* data,
-                             func_t* user_backup_addr)
+                             func_t* user_backup_addr,
+                             ContextLevel context,
+                             ProbeHandler probe)
     : HookHandle(),
       info_(info),
       previous_(nullptr),
@@ -165,13 +475,33 @@ HookHandleExt::HookHandleExt(HookInfo* info,
       post_handler_(post_handler),
       data_(data),
       user_backup_addr_(user_backup_addr),
-      enabled_(true) {
+      enabled_(true),
+      context_(context),
+      handler_index_(HandlerTable::kNoIndex),
+      probe_(probe) {
   address_ = address;
 }
 
+void HookHandleExt::CallProbe(RegisterContext* ctx, HookHandle* handle, void* data) {
+#ifdef __aarch64__
+  auto ra = ctx->lr;
+#else
+  auto ra = ctx->ra;
+#endif
+  static_cast<HookHandleExt*>(handle)->probe_(handle->GetAddress(), ra, data);
+}
+
+// Generated code calls the handlers that were enabled when it was generated
 bool HookHandleExt::SetEnabledExt(bool enabled) {
   auto old = enabled_;
   enabled_ = enabled;
+  if (info_ && enabled != old && handler_index_ != HandlerTable::kNoIndex) {
+    info_->UpdateHandlers(handler_index_);
+    if (!info_->UpdateTrampoline(true)) [[unlikely]] {
+      enabled_ = old;
+      info_->UpdateHandlers(handler_index_);
+    }
+  }
   return old;
 }
 
@@ -187,18 +517,45 @@ bool HookHandleExt::SetEnabledAllExt(bool enabled) {
   return old;
 }
 
+bool HookHandleExt::RetargetExt(func_t new_hook) {
+  auto info = info_;
+  if (!info || !hook_) [[unlikely]] {
+    SET_ERROR("Not a hook");
+    return false;
+  }
+  if (new_hook == hook_) return true;
+
+  // Hooks chained after this one call it through their backup
+  for (auto handle = next_; handle; handle = handle->next_) {
+    handle->UpdateBackup(new_hook);
+    if (handle->hook_) break;
+  }
+
+  ScopedWritableAllocatedMemory unused(info->custom_free ? nullptr : info->trampoline);
+  auto td = info->GetTrampolineData();
+  if (td->hook == hook_) {
+    __atomic_store_n(&td->hook, new_hook, __ATOMIC_RELEASE);
+  }
+  if (td->backup == hook_) {
+    __atomic_store_n(&td->backup, new_hook, __ATOMIC_RELEASE);
+  }
+  hook_ = new_hook;
+  return true;
+}
+
+// The backup may be loaded concurrently by running hooks, so it is replaced with single stores
 void HookHandleExt::UpdateBackup(func_t new_backup) {
   if (user_backup_addr_) [[likely]] {
     if (*user_backup_addr_ == backup_) [[likely]] {
-      *user_backup_addr_ = new_backup;
+      __atomic_store_n(user_backup_addr_, new_backup, __ATOMIC_RELEASE);
     } else {
       user_backup_addr_ = nullptr;
     }
   }
-  backup_ = new_backup;
+  __atomic_store_n(&backup_, new_backup, __ATOMIC_RELEASE);
 }
 
-bool HookHandleExt::UnhookExt() {
+bool HookHandleExt::UnhookExt(bool restore) {
   auto info = info_;
   if (!info) [[unlikely]] {
     return false;
@@ -206,25 +563,38 @@ bool HookHandleExt::UnhookExt() {
 
   if (info->handle_count == 1) {
     delete this;
-    info->Unhook();
+    info->Unhook(restore);
     return true;
-  } else info->handle_count--;
+  }
 
-  ScopedWritableAllocatedMemory unused(info->custom_free ? nullptr : info->trampoline);
   auto td = info->GetTrampolineData();
+  func_t previous_hook = nullptr;
+  for (auto handle = previous_; handle; handle = handle->previous_) {
+    if (!handle->hook_) continue;
+    previous_hook = handle->hook_;
+    break;
+  }
+  // The current code may call this handle directly, so the code for the list without it must
+  // exist before anything changes. Otherwise the handle stays hooked
+  auto hook = hook_ && td->hook == hook_ ? previous_hook : td->hook;
+  void* code;
+  if (!info->GetTrampolineCode(info->GetShape(hook != nullptr, this), true, &code)) [[unlikely]] {
+    return false;
+  }
+  info->handle_count--;
 
+  ScopedWritableAllocatedMemory unused(info->custom_free ? nullptr : info->trampoline);
   if (post_handler_) {
     td->post_handlers--;
   }
+  if (handler_index_ != HandlerTable::kNoIndex) {
+    info->RemoveHandlers(handler_index_);
+  }
   if (info->root_handle == this) {
     info->root_handle = next_;
-    td->root_handle = next_;
   }
-  func_t previous_hook = nullptr;
-  for (auto handle = previous_; handle; handle = handle->previous_) {
-    if (!handle->hook_) continue;
-    previous_hook = handle->hook_;
-    break;
+  if (info->last_handle == this) {
+    info->last_handle = previous_;
   }
   auto new_backup = previous_hook ? previous_hook : info->relocated;
   for (auto handle = next_; handle; handle = handle->next_) {
@@ -242,12 +612,16 @@ bool HookHandleExt::UnhookExt() {
   if (previous_) {
     previous_->next_ = next_;
   }
+  if (next_) {
+    next_->previous_ = previous_;
+  }
+  info->SetTrampolineEntry(code);
   info_ = nullptr;
   delete this;
   return true;
 }
 
-bool HookHandleExt::UnhookAllExt() {
+bool HookHandleExt::UnhookAllExt(bool restore) {
   auto info = info_;
   if (!info) [[unlikely]] {
     return false;
@@ -257,7 +631,7 @@ bool HookHandleExt::UnhookAllExt() {
     auto next = handle->next_;
     delete handle;
     if (!next) {
-      info->Unhook();
+      info->Unhook(restore);
       break;
     }
     handle = next;
@@ -266,21 +640,129 @@ bool HookHandleExt::UnhookAllExt() {
 }
 
 [[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetEnabled(bool enabled) {
+  HookLocker locker(address_);
   return reinterpret_cast<HookHandleExt*>(this)->SetEnabledExt(enabled);
 }
 
 [[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetEnabledAll(bool enabled) {
+  HookLocker locker(address_);
   return reinterpret_cast<HookHandleExt*>(this)->SetEnabledAllExt(enabled);
 }
 
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetEnabledForCurrentThread(
+    bool enabled) {
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info) [[unlikely]] {
+    SET_ERROR("Invalid handle");
+    return false;
+  }
+  return info->SetThreadFilter(enabled, true);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetEnabledByDefault(bool enabled) {
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info) [[unlikely]] {
+    SET_ERROR("Invalid handle");
+    return false;
+  }
+  return info->SetThreadFilter(enabled, false);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::Retarget(func_t new_hook) {
+  if (!new_hook) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  HookLocker locker(address_);
+  ClearError();
+  return reinterpret_cast<HookHandleExt*>(this)->RetargetExt(new_hook);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetCallStatisticsEnabled(
+    bool enabled) {
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info) [[unlikely]] {
+    SET_ERROR("Invalid handle");
+    return false;
+  }
+  return info->SetCallStatisticsEnabled(enabled);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::GetCallStatistics(
+    CallStatistics* stats) {
+  if (!stats) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info || info->stats_slot == CallRecorder::kNoSlot) [[unlikely]] {
+    SET_ERROR("Call statistics are not enabled");
+    return false;
+  }
+  CallRecorder::Collect(info->stats_slot, stats);
+  return true;
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::ResetCallStatistics() {
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info || info->stats_slot == CallRecorder::kNoSlot) [[unlikely]] {
+    SET_ERROR("Call statistics are not enabled");
+    return false;
+  }
+  CallRecorder::Reset(info->stats_slot);
+  return true;
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetSampling(uint32_t rate,
+                                                                        SamplingMode mode) {
+  if (mode != SamplingMode::kEveryNth && mode != SamplingMode::kRandom) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info) [[unlikely]] {
+    SET_ERROR("Invalid handle");
+    return false;
+  }
+  return info->SetSampling(rate, mode);
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool HookHandle::SetReentrancyGuard(bool enabled,
+                                                                               uint8_t group) {
+  if (group >= kReentrancyGroups) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return false;
+  }
+  HookLocker locker(address_);
+  ClearError();
+  auto info = reinterpret_cast<HookHandleExt*>(this)->GetInfo();
+  if (!info) [[unlikely]] {
+    SET_ERROR("Invalid handle");
+    return false;
+  }
+  return info->SetReentrancyGuard(enabled ? static_cast<int8_t>(group) : ReentrancyGuard::kNone);
+}
+
 [[gnu::visibility("default"), maybe_unused]] bool HookHandle::Unhook() {
-  HookLocker locker;
+  HookLocker locker(address_);
   ClearError();
   return reinterpret_cast<HookHandleExt*>(this)->UnhookExt();
 }
 
 [[gnu::visibility("default"), maybe_unused]] bool HookHandle::UnhookAll() {
-  HookLocker locker;
+  HookLocker locker(address_);
   ClearError();
   return reinterpret_cast<HookHandleExt*>(this)->UnhookAllExt();
 }
@@ -18,9 +18,10 @@
 
 #pragma once
 
-#include <map>
+#include <utility>
+#include <vector>
 
-#include "arch/common/handle_offset.h"
+#include "address_index.h"
 #include "arch/common/trampoline.h"
 #include "rv64hook_internal.h"
 
@@ -32,6 +33,12 @@ class HookInfo {
  public:
   func_t address;
   HookHandleExt* root_handle;
+  // Appended to without walking the list
+  HookHandleExt* last_handle;
+  // Also published in TrampolineData, earlier tables are kept until unhook for threads that
+  // may still be walking them
+  HandlerTable* handlers;
+  std::vector<HandlerTable*> retired_handlers;
   void* trampoline;
   decltype(TrampolineAllocator::custom_free) custom_free;
   void* custom_data;
@@ -39,27 +46,88 @@ class HookInfo {
   uint16_t handle_count;
   uint8_t function_backup_size;
   uint8_t function_backup[kMaxFirstTrampolineSize];
+  // Generated second trampolines, kept until unhook since a thread may still be running one.
+  // Bounded by UpdateTrampoline(), which reads the handlers from the table once there are many
+  std::vector<std::pair<TrampolineShape, void*>> generated_trampolines;
+  void* trampoline_entry;
+  // Taken when statistics are first enabled and kept until unhook, old generated code may still
+  // record into it
+  int32_t stats_slot;
+  bool stats_enabled;
+  bool sampled;
+  SamplingMode sampling_mode;
+  // Allocated when sampling is first set and kept until unhook, like stats_slot
+  Sampler::State* sampler;
+  int16_t thread_filter;
+  bool enabled_by_default;
+  int8_t reentrancy_group;
 
   static HookInfo* Lookup(func_t func);
 
+  // Drops the hooks of functions in [begin, end) without restoring them, their handles are
+  // invalid afterwards. The range was unmapped, and if it is `remapped` only hooks whose jump
+  // is gone from the code are dropped
+  static void ForgetRange(uintptr_t begin, uintptr_t end, bool remapped);
+
+  // Whether the jump to the trampoline is still in the function, which must be mapped
+  [[nodiscard]] bool IsPatched() const;
+
+  static size_t Count();
+
   static HookInfo* Create(func_t address,
                           void* trampoline,
                           bool is_user_alloc,
                           void* relocated,
                           uint8_t function_backup_size);
 
+  // Returns nullptr if the trampoline cannot run the new handle, the HookInfo is released if it
+  // had no other handle
   HookHandleExt* NewHookHandle(func_t hook,
                                RegisterHandler pre_handler,
                                RegisterHandler post_handler,
                                void* data,
-                               func_t* user_backup_addr);
+                               func_t* user_backup_addr,
+                               ContextLevel context,
+                               ProbeHandler probe);
 
   [[nodiscard]] TrampolineData* GetTrampolineData() const;
 
+  // Points the trampoline at the generic code, or at code specialized for the current handle
+  // list when it needs features the generic code lacks. `published` is false while no jump to
+  // the trampoline has been written yet. Fails and keeps the current code if the specialized
+  // code cannot be generated
+  bool UpdateTrampoline(bool published);
+
+  // What the trampoline has to run, for the handle list without `removed` when it is set
+  [[nodiscard]] TrampolineShape GetShape(bool replace, const HookHandleExt* removed = nullptr) const;
+
+  // nullptr for the generic code. Generated code is kept, see generated_trampolines
+  bool GetTrampolineCode(TrampolineShape shape, bool published, void** code);
+
+  void SetTrampolineEntry(void* code);
+
   void Unhook(bool initialized = true);
 
+  // The trampoline must be writable
+  uint32_t AddHandlers(HookHandleExt* handle);
+
+  void UpdateHandlers(uint32_t index);
+
+  void RemoveHandlers(uint32_t index);
+
+  bool SetCallStatisticsEnabled(bool enabled);
+
+  bool SetSampling(uint32_t rate, SamplingMode mode);
+
+  // Takes a ThreadFilter index on first use
+  bool SetThreadFilter(bool enabled, bool current_thread);
+
+  bool SetReentrancyGuard(int8_t group);
+
  private:
-  static std::map<func_t, HookInfo*> hooks_;
+  static AddressIndex<HookInfo> hooks_;
+
+  bool AddHookHandle(HookHandleExt* new_handle);
 };
 
 class HookHandleExt : public HookHandle {
@@ -70,39 +138,43 @@ class HookHandleExt : public HookHandle {
                 RegisterHandler pre_handler,
                 RegisterHandler post_handler,
                 void* data,
-                func_t* user_backup_addr);
+                func_t* user_backup_addr,
+                ContextLevel context,
+                ProbeHandler probe);
+
+  // The pre handler of probes, for the generic trampoline
+  static void CallProbe(RegisterContext* ctx, HookHandle* handle, void* data);
 
   bool SetEnabledExt(bool enabled);
 
   bool SetEnabledAllExt(bool enabled);
 
+  bool RetargetExt(func_t new_hook);
+
   void UpdateBackup(func_t new_backup);
 
-  bool UnhookExt();
+  bool UnhookExt(bool restore = true);
+
+  bool UnhookAllExt(bool restore = true);
 
-  bool UnhookAllExt();
+  [[nodiscard]] HookInfo* GetInfo() const {
+    return info_;
+  }
 
  private:
   HookInfo* info_;
   HookHandleExt* previous_;
-  [[maybe_unused]] HookHandleExt* next_;
+  HookHandleExt* next_;
   func_t hook_;
-  [[maybe_unused]] RegisterHandler pre_handler_;
-  [[maybe_unused]] RegisterHandler post_handler_;
-  [[maybe_unused]] void* data_;
+  RegisterHandler pre_handler_;
+  RegisterHandler post_handler_;
+  void* data_;
   func_t* user_backup_addr_;
   bool enabled_;
-
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Winvalid-offsetof"
-  [[maybe_unused]] static void CheckOffsets() {
-    static_assert(offsetof(HookHandleExt, next_) == HookHandle_next);
-    static_assert(offsetof(HookHandleExt, pre_handler_) == HookHandle_pre_handler);
-    static_assert(offsetof(HookHandleExt, post_handler_) == HookHandle_post_handler);
-    static_assert(offsetof(HookHandleExt, data_) == HookHandle_data);
-    static_assert(offsetof(HookHandleExt, enabled_) == HookHandle_enabled);
-  }
-#pragma clang diagnostic pop
+  ContextLevel context_;
+  // Entry in HookInfo::handlers, HandlerTable::kNoIndex without handlers
+  uint32_t handler_index_;
+  ProbeHandler probe_;
 
   friend class HookInfo;
 };
@@ -20,14 +20,49 @@
 
 namespace rv64hook {
 
-pthread_mutex_t HookLocker::mutex_ = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#define RECURSIVE_MUTEX_INITIALIZER_X4                                          \
+  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, \
+      PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+#define RECURSIVE_MUTEX_INITIALIZER_X16                                \
+  RECURSIVE_MUTEX_INITIALIZER_X4, RECURSIVE_MUTEX_INITIALIZER_X4,      \
+      RECURSIVE_MUTEX_INITIALIZER_X4, RECURSIVE_MUTEX_INITIALIZER_X4
 
-HookLocker::HookLocker() {
-  pthread_mutex_lock(&mutex_);
+pthread_mutex_t HookLocker::mutexes_[kShardCount] = {RECURSIVE_MUTEX_INITIALIZER_X16,
+                                                     RECURSIVE_MUTEX_INITIALIZER_X16};
+
+#undef RECURSIVE_MUTEX_INITIALIZER_X16
+#undef RECURSIVE_MUTEX_INITIALIZER_X4
+
+HookLocker::HookLocker() : shards_(UINT32_MAX) {
+  Lock();
+}
+
+HookLocker::HookLocker(const void* address) : shards_(1U << GetShard(address)) {
+  Lock();
+}
+
+HookLocker::HookLocker(const void* const* addresses, size_t count) : shards_(0) {
+  for (size_t i = 0; i < count; ++i) {
+    shards_ |= 1U << GetShard(addresses[i]);
+  }
+  Lock();
 }
 
 HookLocker::~HookLocker() {
-  pthread_mutex_unlock(&mutex_);
+  for (auto shards = shards_; shards; shards &= shards - 1) {
+    pthread_mutex_unlock(&mutexes_[__builtin_ctz(shards)]);
+  }
+}
+
+uint32_t HookLocker::GetShard(const void* address) {
+  auto key = reinterpret_cast<uintptr_t>(address) >> 1;
+  return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> (64 - __builtin_ctz(kShardCount)));
+}
+
+void HookLocker::Lock() {
+  for (auto shards = shards_; shards; shards &= shards - 1) {
+    pthread_mutex_lock(&mutexes_[__builtin_ctz(shards)]);
+  }
 }
 
 }  // namespace rv64hook
@@ -20,16 +20,41 @@
 
 #include <pthread.h>
 
+#include <cstddef>
+#include <cstdint>
+
 namespace rv64hook {
 
+// Hook state is guarded per function, functions are spread over a fixed set of recursive
+// mutexes so that unrelated functions can be hooked in parallel.
+// Shards are always acquired in ascending order.
 class HookLocker {
  public:
+  // Locks every shard, for state shared by all functions
   HookLocker();
 
+  explicit HookLocker(const void* address);
+
+  HookLocker(const void* const* addresses, size_t count);
+
   ~HookLocker();
 
+  HookLocker(const HookLocker&) = delete;
+
+  HookLocker& operator=(const HookLocker&) = delete;
+
  private:
-  static pthread_mutex_t mutex_;
+  static constexpr size_t kShardCount = 32;
+
+  static_assert(kShardCount == sizeof(uint32_t) * 8, "Bad kShardCount");
+
+  static pthread_mutex_t mutexes_[kShardCount];
+
+  uint32_t shards_;
+
+  static uint32_t GetShard(const void* address);
+
+  void Lock();
 };
 
 }  // namespace rv64hook
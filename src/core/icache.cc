@@ -0,0 +1,127 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "icache.h"
+
+#include <linux/membarrier.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "libc/libc.h"
+
+namespace rv64hook {
+
+std::atomic<uint64_t> ICache::syncs_;
+std::atomic<uint64_t> ICache::ranges_;
+
+static constexpr size_t kMaxPendingRanges = 16;
+
+// Plain data so that queuing a range never allocates. Ranges beyond kMaxPendingRanges are only
+// accounted for in low and high, Sync() then flushes that whole range at once.
+struct PendingRanges {
+  int depth;
+  size_t count;
+  uintptr_t low;
+  uintptr_t high;
+  uintptr_t begins[kMaxPendingRanges];
+  uintptr_t ends[kMaxPendingRanges];
+};
+
+static thread_local PendingRanges pending_{};
+
+// 0 until probed, then 1 if SYNC_CORE is registered for this process, -1 otherwise
+static std::atomic<int> sync_core_state_ = 0;
+
+static void Flush(uintptr_t begin, uintptr_t end) {
+  libc_flush_icache(reinterpret_cast<void*>(begin), reinterpret_cast<void*>(end));
+}
+
+void ICache::Invalidate(const void* address, size_t size) {
+  auto begin = reinterpret_cast<uintptr_t>(address);
+  auto end = begin + size;
+  ranges_.fetch_add(1, std::memory_order_relaxed);
+  if (pending_.depth == 0) {
+    Flush(begin, end);
+    SyncCore();
+    syncs_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto& pending = pending_;
+  if (pending.count < kMaxPendingRanges) {
+    pending.begins[pending.count] = begin;
+    pending.ends[pending.count] = end;
+  }
+  pending.low = pending.count ? std::min(pending.low, begin) : begin;
+  pending.high = pending.count ? std::max(pending.high, end) : end;
+  ++pending.count;
+}
+
+void ICache::Sync() {
+  auto& pending = pending_;
+  if (pending.count == 0) return;
+
+#ifdef __riscv
+  // The kernel flushes the whole instruction cache of every hart regardless of the range
+  Flush(pending.low, pending.high);
+#else
+  if (pending.count > kMaxPendingRanges) {
+    Flush(pending.low, pending.high);
+  } else {
+    for (size_t i = 0; i < pending.count; ++i) {
+      Flush(pending.begins[i], pending.ends[i]);
+    }
+  }
+#endif
+  pending.count = 0;
+  SyncCore();
+  syncs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ICache::SyncCore() {
+  auto state = sync_core_state_.load(std::memory_order_acquire);
+  if (state == 0) {
+    state = -1;
+    auto commands = libc_membarrier(MEMBARRIER_CMD_QUERY, 0);
+    if (commands > 0 && (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) &&
+        libc_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0) {
+      state = 1;
+    }
+    sync_core_state_.store(state, std::memory_order_release);
+  }
+  if (state > 0) {
+    libc_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+  }
+}
+
+void ICache::ResetCounters() {
+  syncs_.store(0, std::memory_order_relaxed);
+  ranges_.store(0, std::memory_order_relaxed);
+}
+
+ScopedICacheSync::ScopedICacheSync() {
+  ++pending_.depth;
+}
+
+ScopedICacheSync::~ScopedICacheSync() {
+  if (--pending_.depth == 0) {
+    ICache::Sync();
+  }
+}
+
+}  // namespace rv64hook
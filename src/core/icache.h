@@ -0,0 +1,66 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace rv64hook {
+
+// Makes patched code visible to every hart. Ranges invalidated while a ScopedICacheSync is
+// alive on the calling thread are collected and synchronized together, with one
+// riscv_flush_icache followed by membarrier(SYNC_CORE) where the kernel supports it, so that
+// harts already running the old code pass a context synchronization point too.
+class ICache {
+ public:
+  static void Invalidate(const void* address, size_t size);
+
+  // Synchronizes the ranges collected so far on this thread, e.g. before publishing a jump
+  // into freshly written code
+  static void Sync();
+
+  static uint64_t GetSyncCount() {
+    return syncs_.load(std::memory_order_relaxed);
+  }
+
+  static uint64_t GetRangeCount() {
+    return ranges_.load(std::memory_order_relaxed);
+  }
+
+  static void ResetCounters();
+
+ private:
+  static std::atomic<uint64_t> syncs_;
+  static std::atomic<uint64_t> ranges_;
+
+  static void SyncCore();
+};
+
+class ScopedICacheSync {
+ public:
+  ScopedICacheSync();
+
+  ~ScopedICacheSync();
+
+  ScopedICacheSync(const ScopedICacheSync&) = delete;
+
+  ScopedICacheSync& operator=(const ScopedICacheSync&) = delete;
+};
+
+}  // namespace rv64hook
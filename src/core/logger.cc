@@ -26,8 +26,8 @@
 
 namespace rv64hook {
 
-static char error_buf[128];
-static bool has_error = false;
+static thread_local char error_buf[128];
+static thread_local bool has_error = false;
 
 void ClearError() {
   has_error = false;
@@ -22,6 +22,7 @@
 
 #include "memory.h"
 
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/uio.h>
@@ -31,10 +32,10 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <set>
 
 #include "arch/common/trampoline.h"
-#include "hook_locker.h"
 #include "libc/libc.h"
 #include "logger.h"
 #include "rv64hook.h"
@@ -73,9 +74,59 @@ static constexpr size_t kAlignment = sizeof(MemoryHeader);
 
 static_assert(kAlignment % sizeof(void*) == 0, "Bad kAlignment");
 
+static constexpr uint32_t kMaxSlabSlots = 64;
+static constexpr size_t kMaxSlotSize = 256;
+
+// A run of chunks split into equal slots, for objects well below a chunk. The bookkeeping stays
+// out of the executable heap
+struct Slab {
+  uint8_t* base;
+  uint32_t slot_size;
+  uint32_t capacity;
+  uint64_t used;
+  // Links of the list of slabs that still have a free slot
+  Slab* previous;
+  Slab* next;
+
+  [[nodiscard]] bool IsFull() const {
+    return used == (capacity == kMaxSlabSlots ? ~0ULL : (1ULL << capacity) - 1);
+  }
+};
+
+// Keyed by base address, so that a slot finds its slab with one lookup
+static std::map<uintptr_t, Slab> slabs_;
+static Slab* free_slabs_ = nullptr;
+
 Memory* Memory::default_allocator_ = nullptr;
 Memory* Memory::root_allocator_ = nullptr;
 
+// Allocators are shared by every function, so they have their own lock instead of a hook shard
+static pthread_mutex_t memory_mutex_ = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+class MemoryLocker {
+ public:
+  MemoryLocker() {
+    pthread_mutex_lock(&memory_mutex_);
+  }
+
+  ~MemoryLocker() {
+    pthread_mutex_unlock(&memory_mutex_);
+  }
+};
+
+static void LinkFreeSlab(Slab* slab) {
+  slab->previous = nullptr;
+  slab->next = free_slabs_;
+  if (free_slabs_) free_slabs_->previous = slab;
+  free_slabs_ = slab;
+}
+
+static void UnlinkFreeSlab(Slab* slab) {
+  if (slab->previous) slab->previous->next = slab->next;
+  else free_slabs_ = slab->next;
+  if (slab->next) slab->next->previous = slab->previous;
+}
+
 static MemoryHeader* GetMemoryHeader(void* ptr) {
   if (!ptr) [[unlikely]] {
     return nullptr;
@@ -95,6 +146,8 @@ void* Memory::Alloc(size_t size) {
     return nullptr;
   }
 
+  MemoryLocker locker;
+
   for (auto allocator = default_allocator_; allocator; allocator = allocator->next_) {
     auto ptr = allocator->DoAlloc(size);
     if (ptr) return ptr;
@@ -117,6 +170,8 @@ void* Memory::Alloc(size_t size, uintptr_t start, uintptr_t end) {
   start = __builtin_align_up(start, page_size);
   end = __builtin_align_down(end, page_size);
 
+  MemoryLocker locker;
+
   for (auto allocator = root_allocator_; allocator; allocator = allocator->next_) {
     auto heap_start = reinterpret_cast<uintptr_t>(allocator->heap_);
     if (heap_start < start) continue;
@@ -136,6 +191,7 @@ void* Memory::Alloc(size_t size, uintptr_t start, uintptr_t end) {
 }
 
 void* Memory::Realloc(void* ptr, size_t size) {
+  MemoryLocker locker;
   auto header = GetMemoryHeader(ptr);
   if (!header) [[unlikely]] {
     return nullptr;
@@ -145,6 +201,8 @@ void* Memory::Realloc(void* ptr, size_t size) {
 }
 
 void Memory::Free(void* ptr) {
+  MemoryLocker locker;
+  if (FreeSlotLocked(ptr)) return;
   auto header = GetMemoryHeader(ptr);
   if (!header) [[unlikely]] {
     return;
@@ -153,6 +211,75 @@ void Memory::Free(void* ptr) {
   header->allocator->DoFree(ptr);
 }
 
+// Only slabs with a free slot are searched, full ones leave the list until a slot is freed
+void* Memory::AllocSlot(size_t size, uintptr_t start, uintptr_t end) {
+  size = __builtin_align_up(size, sizeof(void*));
+  if (size == 0 || size > kMaxSlotSize) [[unlikely]] {
+    return nullptr;
+  }
+  auto ranged = start || end;
+
+  MemoryLocker locker;
+
+  for (auto slab = free_slabs_; slab; slab = slab->next) {
+    if (slab->slot_size != size) continue;
+    auto base = reinterpret_cast<uintptr_t>(slab->base);
+    if (ranged && (base < start || base + slab->capacity * size > end)) continue;
+    auto index = __builtin_ctzll(~slab->used);
+    slab->used |= 1ULL << index;
+    if (slab->IsFull()) UnlinkFreeSlab(slab);
+    return slab->base + index * size;
+  }
+
+  // As many chunks as kMaxSlabSlots slots take, the tail of the last one holds a few more
+  auto bytes = __builtin_align_up(kMaxSlabSlots * size + kAlignment, kChunkSize) - kAlignment;
+  auto base = ranged ? Alloc(bytes, start, end) : Alloc(bytes);
+  if (!base) [[unlikely]] {
+    return nullptr;
+  }
+  auto& slab = slabs_[reinterpret_cast<uintptr_t>(base)];
+  slab = {static_cast<uint8_t*>(base),
+          static_cast<uint32_t>(size),
+          static_cast<uint32_t>(std::min<size_t>(kMaxSlabSlots, bytes / size)),
+          1,
+          nullptr,
+          nullptr};
+  LinkFreeSlab(&slab);
+  return base;
+}
+
+void Memory::FreeSlot(void* ptr) {
+  MemoryLocker locker;
+  FreeSlotLocked(ptr);
+}
+
+// False if `ptr` is not in a slab
+bool Memory::FreeSlotLocked(void* ptr) {
+  auto address = reinterpret_cast<uintptr_t>(ptr);
+  auto it = slabs_.upper_bound(address);
+  if (it == slabs_.begin()) {
+    return false;
+  }
+  auto& slab = (--it)->second;
+  auto offset = address - it->first;
+  if (offset >= slab.capacity * slab.slot_size) {
+    return false;
+  }
+
+  auto was_full = slab.IsFull();
+  slab.used &= ~(1ULL << (offset / slab.slot_size));
+  if (!slab.used) {
+    if (!was_full) UnlinkFreeSlab(&slab);
+    auto base = slab.base;
+    // Before the run goes back to the heap, so Free() does not find it again
+    slabs_.erase(it);
+    Free(base);
+  } else if (was_full) {
+    LinkFreeSlab(&slab);
+  }
+  return true;
+}
+
 #if !defined(RV64HOOK_USE_PROCESS_VM) || (defined(__ANDROID__) && __ANDROID_API__ < 23)
 bool Memory::Copy(void* addr, const void* src, size_t size) {
   libc_memcpy(addr, src, size);
@@ -174,6 +301,30 @@ bool Memory::Copy(void* addr, const void* src, size_t size) {
 }
 #endif
 
+void Memory::GetUsage(size_t* mapped, size_t* allocated) {
+  MemoryLocker locker;
+  *mapped = 0;
+  *allocated = 0;
+  for (auto list : {default_allocator_, root_allocator_}) {
+    for (auto allocator = list; allocator; allocator = allocator->next_) {
+      *mapped += allocator->heap_size_;
+      *allocated += allocator->allocated_chunks_ * kChunkSize;
+    }
+  }
+}
+
+Memory* Memory::FindAllocator(const void* ptr) {
+  auto address = static_cast<const uint8_t*>(ptr);
+  for (auto list : {default_allocator_, root_allocator_}) {
+    for (auto allocator = list; allocator; allocator = allocator->next_) {
+      if (address >= allocator->heap_ && address < allocator->heap_ + allocator->heap_size_) {
+        return allocator;
+      }
+    }
+  }
+  return nullptr;
+}
+
 int Memory::AllocChunk(uint8_t* chunk_table, size_t total_chunks, size_t chunk_count) {
   int start_chunk = -1;
   int count = 0;
@@ -372,13 +523,18 @@ void Memory::ProtectOSMemory(void* ptr, size_t size, bool writable) {
   libc_mprotect(ptr, size, writable ? PROT_READ | PROT_WRITE | PROT_EXEC : PROT_READ | PROT_EXEC);
 }
 
+// By address rather than through the header, slots inside a slab have none of their own and the
+// bytes in front of them belong to the previous slot
 ScopedWritableAllocatedMemory::ScopedWritableAllocatedMemory(void* ptr) {
-  auto header = GetMemoryHeader(ptr);
-  if (!header) [[unlikely]] {
+  if (!ptr) [[unlikely]] {
     return;
   }
 
-  allocator_ = header->allocator;
+  MemoryLocker locker;
+  allocator_ = Memory::FindAllocator(ptr);
+  if (!allocator_) [[unlikely]] {
+    return;
+  }
   if (++(allocator_->references_) == 1) {
     Memory::ProtectOSMemory(allocator_->heap_, allocator_->heap_size_, true);
   }
@@ -386,13 +542,19 @@ ScopedWritableAllocatedMemory::ScopedWritableAllocatedMemory(void* ptr) {
 
 ScopedWritableAllocatedMemory::ScopedWritableAllocatedMemory(Memory* allocator)
     : allocator_(allocator) {
+  MemoryLocker locker;
   if (++(allocator_->references_) == 1) {
     Memory::ProtectOSMemory(allocator_->heap_, allocator_->heap_size_, true);
   }
 }
 
 ScopedWritableAllocatedMemory::~ScopedWritableAllocatedMemory() {
-  if (allocator_ && --(allocator_->references_) == 0) {
+  if (!allocator_) [[unlikely]] {
+    return;
+  }
+
+  MemoryLocker locker;
+  if (--(allocator_->references_) == 0) {
     Memory::ProtectOSMemory(allocator_->heap_, allocator_->heap_size_, false);
   }
 }
@@ -36,8 +36,16 @@ class Memory {
 
   static void Free(void* ptr);
 
+  // Packs objects of the same size, up to 256 bytes, several to a chunk run, within [start, end)
+  // unless both are 0. Slots are released with FreeSlot() or Free()
+  static void* AllocSlot(size_t size, uintptr_t start, uintptr_t end);
+
+  static void FreeSlot(void* ptr);
+
   static bool Copy(void* addr, const void* src, size_t size);
 
+  static void GetUsage(size_t* mapped, size_t* allocated);
+
  private:
   static constexpr const char* kTag = "Memory";
 
@@ -62,6 +70,10 @@ class Memory {
                               size_t min_size,
                               size_t recommended_size = 0);
 
+  static Memory* FindAllocator(const void* ptr);
+
+  static bool FreeSlotLocked(void* ptr);
+
   static int AllocChunk(uint8_t* chunk_table, size_t total_chunks, size_t chunk_count);
 
   static void* AllocOSMemory(size_t size, void* start = nullptr);
@@ -0,0 +1,98 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "parallel_for.h"
+
+#include <pthread.h>
+
+namespace rv64hook {
+
+// One job at a time, later callers run theirs alone instead of waiting
+static pthread_mutex_t job_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_ = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_ = PTHREAD_COND_INITIALIZER;
+// Workers of the process that started them, a forked child has none
+static pid_t pool_pid_ = 0;
+static size_t started_ = 0;
+// Bumped for every job, workers join a job they have not seen yet while it wants more hands
+static uintptr_t generation_ = 0;
+static size_t wanted_ = 0;
+static size_t running_ = 0;
+static void (*run_)(void*) = nullptr;
+static void* arg_ = nullptr;
+
+// Started with the generation before the job it is started for
+static void* Work(void* generation) {
+  auto seen = reinterpret_cast<uintptr_t>(generation);
+  pthread_mutex_lock(&pool_mutex_);
+  for (;;) {
+    while (generation_ == seen) pthread_cond_wait(&wake_, &pool_mutex_);
+    seen = generation_;
+    if (!wanted_) continue;
+    --wanted_;
+    auto run = run_;
+    auto arg = arg_;
+    pthread_mutex_unlock(&pool_mutex_);
+
+    run(arg);
+
+    pthread_mutex_lock(&pool_mutex_);
+    if (--running_ == 0) pthread_cond_signal(&done_);
+  }
+  return nullptr;
+}
+
+void RunOnWorkers(size_t workers, void (*run)(void*), void* arg) {
+  if (workers <= 1 || pthread_mutex_trylock(&job_mutex_) != 0) {
+    run(arg);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_mutex_);
+  if (auto pid = getpid(); pool_pid_ != pid) {
+    pool_pid_ = pid;
+    started_ = 0;
+    pthread_cond_init(&wake_, nullptr);
+    pthread_cond_init(&done_, nullptr);
+  }
+  auto helpers = std::min(workers, kMaxParallelWorkers) - 1;
+  for (; started_ < helpers; ++started_) {
+    pthread_t thread;
+    auto generation = reinterpret_cast<void*>(generation_);
+    if (pthread_create(&thread, nullptr, Work, generation) != 0) [[unlikely]] {
+      break;
+    }
+    pthread_detach(thread);
+  }
+  run_ = run;
+  arg_ = arg;
+  wanted_ = std::min(helpers, started_);
+  running_ = wanted_;
+  ++generation_;
+  pthread_cond_broadcast(&wake_);
+  pthread_mutex_unlock(&pool_mutex_);
+
+  run(arg);
+
+  pthread_mutex_lock(&pool_mutex_);
+  while (running_) pthread_cond_wait(&done_, &pool_mutex_);
+  pthread_mutex_unlock(&pool_mutex_);
+  pthread_mutex_unlock(&job_mutex_);
+}
+
+}  // namespace rv64hook
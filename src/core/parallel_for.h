@@ -0,0 +1,68 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+namespace rv64hook {
+
+static constexpr size_t kMaxParallelWorkers = 8;
+
+// Calls run(arg) on up to `workers` - 1 threads of a pool plus the caller, and returns once
+// every call has. The pool is started on first use and kept, each call splits the work itself.
+// While another caller uses the pool, run(arg) only runs on the calling thread
+void RunOnWorkers(size_t workers, void (*run)(void*), void* arg);
+
+// Calls fn(i) for every i in [0, count) on a few pooled threads plus the caller.
+// Inputs smaller than min_items_per_worker * 2 run inline, and if a thread cannot be started
+// the remaining threads simply pick up its share.
+template <typename F>
+void ParallelFor(size_t count, size_t min_items_per_worker, const F& fn) {
+  auto cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  auto workers = std::min({static_cast<size_t>(cpus > 0 ? cpus : 1),
+                           kMaxParallelWorkers,
+                           count / std::max<size_t>(min_items_per_worker, 1)});
+  if (workers <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  struct Context {
+    const F* fn;
+    size_t count;
+    std::atomic<size_t> next;
+
+    static void Run(void* arg) {
+      auto context = static_cast<Context*>(arg);
+      for (size_t i; (i = context->next.fetch_add(1, std::memory_order_relaxed)) <
+                     context->count;) {
+        (*context->fn)(i);
+      }
+    }
+  } context{&fn, count, {0}};
+
+  RunOnWorkers(workers, Context::Run, &context);
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,71 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.h"
+
+#include "hook_handle.h"
+#include "icache.h"
+#include "memory.h"
+
+namespace rv64hook {
+
+std::atomic<uint64_t> Profiler::phase_ns_[InstallStatistics::kPhaseCount];
+std::atomic<uint64_t> Profiler::installs_;
+std::atomic<uint64_t> Profiler::cache_hits_;
+std::atomic<uint64_t> Profiler::cache_misses_;
+
+void Profiler::Collect(InstallStatistics* stats) {
+  for (int i = 0; i < InstallStatistics::kPhaseCount; ++i) {
+    stats->phase_ns[i] = phase_ns_[i].load(std::memory_order_relaxed);
+  }
+  stats->installs = installs_.load(std::memory_order_relaxed);
+  stats->relocation_cache_hits = cache_hits_.load(std::memory_order_relaxed);
+  stats->relocation_cache_misses = cache_misses_.load(std::memory_order_relaxed);
+  stats->icache_syncs = ICache::GetSyncCount();
+  stats->icache_ranges = ICache::GetRangeCount();
+  stats->hooked_functions = HookInfo::Count();
+  Memory::GetUsage(&stats->heap_mapped, &stats->heap_allocated);
+}
+
+void Profiler::Reset() {
+  for (auto& ns : phase_ns_) {
+    ns.store(0, std::memory_order_relaxed);
+  }
+  installs_.store(0, std::memory_order_relaxed);
+  cache_hits_.store(0, std::memory_order_relaxed);
+  cache_misses_.store(0, std::memory_order_relaxed);
+  ICache::ResetCounters();
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool GetInstallStatistics(InstallStatistics* stats) {
+  if (!stats) [[unlikely]] {
+    return false;
+  }
+  Profiler::Collect(stats);
+#ifdef RV64HOOK_ENABLE_PROFILING
+  return true;
+#else
+  return false;
+#endif
+}
+
+[[gnu::visibility("default"), maybe_unused]] void ResetInstallStatistics() {
+  Profiler::Reset();
+}
+
+}  // namespace rv64hook
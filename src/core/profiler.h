@@ -0,0 +1,84 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+#include "rv64hook.h"
+
+namespace rv64hook {
+
+using InstallPhase = InstallStatistics::Phase;
+
+class Profiler {
+ public:
+  static void Record(InstallPhase phase, uint64_t ns) {
+    phase_ns_[phase].fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  static void CountInstall(uint64_t count = 1) {
+    installs_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  static void CountCacheLookup(bool hit) {
+    (hit ? cache_hits_ : cache_misses_).fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void Collect(InstallStatistics* stats);
+
+  static void Reset();
+
+  static uint64_t Now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+ private:
+  static std::atomic<uint64_t> phase_ns_[InstallStatistics::kPhaseCount];
+  static std::atomic<uint64_t> installs_;
+  static std::atomic<uint64_t> cache_hits_;
+  static std::atomic<uint64_t> cache_misses_;
+};
+
+#ifdef RV64HOOK_ENABLE_PROFILING
+class ScopedPhaseTimer {
+ public:
+  explicit ScopedPhaseTimer(InstallPhase phase) : phase_(phase), start_(Profiler::Now()) {
+  }
+
+  ~ScopedPhaseTimer() {
+    Profiler::Record(phase_, Profiler::Now() - start_);
+  }
+
+ private:
+  InstallPhase phase_;
+  uint64_t start_;
+};
+#else
+class ScopedPhaseTimer {
+ public:
+  explicit ScopedPhaseTimer(InstallPhase) {
+  }
+};
+#endif
+
+}  // namespace rv64hook
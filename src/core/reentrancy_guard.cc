@@ -0,0 +1,39 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "reentrancy_guard.h"
+
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+STATIC_TLS static thread_local ReentrancyGuard::Block block_{};
+
+bool ReentrancyGuard::IsActive(int8_t group) {
+  return block_.active[group] != 0;
+}
+
+void ReentrancyGuard::SetActive(int8_t group, bool active) {
+  block_.active[group] = active;
+}
+
+bool ReentrancyGuard::GetThreadPointerOffset(intptr_t* offset) {
+  return rv64hook::GetThreadPointerOffset(&block_, offset);
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,47 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "rv64hook.h"
+
+namespace rv64hook {
+
+// Per-thread "in handler" flags, one byte per group so the trampolines set and clear them with
+// plain stores. A guarded function checks the flag of its group on entry before anything is
+// saved, and its handlers run with the flag set
+class ReentrancyGuard {
+ public:
+  static constexpr int8_t kNone = -1;
+  static constexpr int kMaxGroups = HookHandle::kReentrancyGroups;
+
+  struct Block {
+    uint8_t active[kMaxGroups];
+  };
+
+  // Called by trampolines where the block is not in static TLS
+  static bool IsActive(int8_t group);
+
+  static void SetActive(int8_t group, bool active);
+
+  static bool GetThreadPointerOffset(intptr_t* offset);
+};
+
+}  // namespace rv64hook
@@ -0,0 +1,447 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "relocation_cache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arch/common/trampoline.h"
+#include "elf/elf_resolver.h"
+#include "logger.h"
+#include "memory.h"
+#include "profiler.h"
+
+namespace rv64hook {
+
+static constexpr const char* kTag = "Relocation Cache";
+
+// Bump whenever the relocator output or the layout below changes
+static constexpr uint32_t kVersion = 2;
+static constexpr char kMagic[8] = {'R', 'V', '6', '4', 'R', 'L', 'C', '\0'};
+// Stale entries are never compacted, appending simply stops here
+static constexpr size_t kMaxFileSize = 16 << 20;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+// Followed by code_size bytes of code, then literal_count Literals at the next 8-byte boundary,
+// then load_count Loads padded to 8 bytes
+struct Record {
+  // Including the code, the literals and the loads, a multiple of 8
+  uint32_t size;
+  // FNV-1a of everything after this field
+  uint32_t checksum;
+  uint64_t module;
+  uint64_t offset;
+  uint8_t type;
+  uint8_t overwrite_size;
+  uint16_t code_size;
+  uint16_t literal_count;
+  uint16_t load_count;
+  uint8_t original[kMaxFirstTrampolineSize];
+};
+
+struct Literal {
+  uint32_t offset;
+  uint32_t reserved;
+  // From the function address
+  int64_t delta;
+};
+
+struct Load {
+  uint16_t position;
+  uint16_t jump;
+};
+
+struct Key {
+  uint64_t module;
+  uint64_t offset;
+  uint8_t type;
+
+  bool operator==(const Key&) const = default;
+};
+
+struct KeyHash {
+  size_t operator()(const Key& key) const {
+    return static_cast<size_t>((key.module ^ (key.offset << 4) ^ key.type) *
+                               0x9E3779B97F4A7C15ULL);
+  }
+};
+
+static pthread_mutex_t cache_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> enabled_ = false;
+static int fd_ = -1;
+// Set while a torn record could not be dropped, appends would land behind it
+static bool read_only_ = false;
+static std::unordered_map<Key, const Record*, KeyHash> records_;
+// Private copy of the file as read by Open(), other processes may replace it at any time
+static std::vector<uint8_t> loaded_;
+// Records stored by this process
+static std::vector<std::vector<uint8_t>> appended_;
+
+class CacheLocker {
+ public:
+  CacheLocker() {
+    pthread_mutex_lock(&cache_mutex_);
+  }
+
+  ~CacheLocker() {
+    pthread_mutex_unlock(&cache_mutex_);
+  }
+};
+
+// Serializes access to the file between processes
+class FileLocker {
+ public:
+  explicit FileLocker(int fd) : fd_(fd) {
+    flock(fd_, LOCK_EX);
+  }
+
+  ~FileLocker() {
+    flock(fd_, LOCK_UN);
+  }
+
+ private:
+  int fd_;
+};
+
+static uint64_t Fnv1a64(const void* data, size_t size) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (auto p = static_cast<const uint8_t*>(data); size--; ++p) {
+    h = (h ^ *p) * 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static uint32_t Checksum(const Record* record) {
+  auto begin = reinterpret_cast<const uint8_t*>(record) + offsetof(Record, module);
+  auto end = reinterpret_cast<const uint8_t*>(record) + record->size;
+  return static_cast<uint32_t>(Fnv1a64(begin, end - begin));
+}
+
+static constexpr size_t GetLiteralsOffset(size_t code_size) {
+  return __builtin_align_up(sizeof(Record) + code_size, alignof(Literal));
+}
+
+static const Literal* GetLiterals(const Record* record) {
+  return reinterpret_cast<const Literal*>(reinterpret_cast<const uint8_t*>(record) +
+                                          GetLiteralsOffset(record->code_size));
+}
+
+static constexpr size_t GetRecordSize(size_t code_size,
+                                       size_t literal_count,
+                                       size_t load_count) {
+  return GetLiteralsOffset(code_size) + literal_count * sizeof(Literal) +
+         __builtin_align_up(load_count * sizeof(Load), alignof(Record));
+}
+
+static constexpr size_t kMaxRecordSize = GetRecordSize(
+    RelocatedCode::kMaxCodeSize, RelocatedCode::kMaxLiterals, RelocatedCode::kMaxLiterals);
+
+static const Load* GetLoads(const Record* record) {
+  return reinterpret_cast<const Load*>(GetLiterals(record) + record->literal_count);
+}
+
+static bool IsValid(const Record* record, size_t available) {
+  if (record->size < sizeof(Record) || record->size % alignof(Record) != 0 ||
+      record->size > available) {
+    return false;
+  }
+  if (record->overwrite_size > kMaxFirstTrampolineSize ||
+      record->code_size > RelocatedCode::kMaxCodeSize ||
+      record->literal_count > RelocatedCode::kMaxLiterals ||
+      record->load_count > RelocatedCode::kMaxLiterals ||
+      GetRecordSize(record->code_size, record->literal_count, record->load_count) !=
+          record->size) {
+    return false;
+  }
+  return Checksum(record) == record->checksum;
+}
+
+static bool GetKey(func_t address, TrampolineType type, Key* key) {
+  uint8_t build_id[ElfResolver::kMaxBuildIdSize];
+  size_t build_id_size;
+  uintptr_t base;
+  if (!ElfResolver::FindModule(address, build_id, &build_id_size, &base) || !build_id_size) {
+    return false;
+  }
+  key->module = Fnv1a64(build_id, build_id_size);
+  key->offset = reinterpret_cast<uintptr_t>(address) - base;
+  key->type = static_cast<uint8_t>(type);
+  return true;
+}
+
+static void CloseLocked() {
+  enabled_ = false;
+  records_.clear();
+  loaded_.clear();
+  loaded_.shrink_to_fit();
+  appended_.clear();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  read_only_ = false;
+}
+
+// Returns the length of the valid prefix of the file
+static size_t LoadRecords(const uint8_t* data, size_t size) {
+  auto header = reinterpret_cast<const FileHeader*>(data);
+  if (size < sizeof(FileHeader) || memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion || header->record_size != sizeof(Record)) {
+    return 0;
+  }
+
+  size_t offset = sizeof(FileHeader);
+  while (offset + sizeof(Record) <= size) {
+    auto record = reinterpret_cast<const Record*>(data + offset);
+    if (!IsValid(record, size - offset)) break;
+    // Later records supersede earlier ones for the same function
+    records_[{record->module, record->offset, record->type}] = record;
+    offset += record->size;
+  }
+  return offset;
+}
+
+// Opens `path` and locks it, retrying if another process replaced the file in between
+static int OpenLocked(const char* path) {
+  for (int attempt = 0; attempt < 8; ++attempt) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    flock(fd, LOCK_EX);
+    struct stat opened {}, current {};
+    if (fstat(fd, &opened) == 0 && stat(path, &current) == 0 && opened.st_dev == current.st_dev &&
+        opened.st_ino == current.st_ino) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+static size_t ReadAll(int fd, uint8_t* data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    auto n = pread(fd, data + done, size - done, static_cast<off_t>(done));
+    if (n <= 0) break;
+    done += static_cast<size_t>(n);
+  }
+  return done;
+}
+
+static bool WriteAll(int fd, const void* data, size_t size) {
+  for (auto p = static_cast<const uint8_t*>(data); size;) {
+    auto n = write(fd, p, size);
+    if (n <= 0) return false;
+    p += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Writes a fresh file holding `size` bytes of records and renames it over `path`. Processes that
+// still have the old file open keep a consistent view of it.
+static int Rebuild(const char* path, const uint8_t* records, size_t size) {
+  std::string temp = std::string(path) + ".XXXXXX";
+  int fd = mkostemp(temp.data(), O_APPEND | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  FileHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.record_size = sizeof(Record);
+  if (!WriteAll(fd, &header, sizeof(header)) || !WriteAll(fd, records, size) ||
+      rename(temp.c_str(), path) != 0) [[unlikely]] {
+    close(fd);
+    unlink(temp.c_str());
+    return -1;
+  }
+  return fd;
+}
+
+bool RelocationCache::Open(const char* path) {
+  CacheLocker locker;
+  CloseLocked();
+  if (!path) return true;
+
+  fd_ = OpenLocked(path);
+  if (fd_ < 0) [[unlikely]] {
+    SET_ERROR("Failed to open %s", path);
+    return false;
+  }
+
+  struct stat st {};
+  if (fstat(fd_, &st) != 0) [[unlikely]] {
+    SET_ERROR("Failed to stat %s", path);
+    CloseLocked();
+    return false;
+  }
+
+  loaded_.resize(static_cast<size_t>(st.st_size));
+  auto size = ReadAll(fd_, loaded_.data(), loaded_.size());
+  auto valid = LoadRecords(loaded_.data(), size);
+
+  if (valid == 0 || valid < size) {
+    // Missing, written by another version, corrupted or torn by a crash. Other processes may be
+    // reading the file, so it is replaced rather than truncated, and only the valid records of a
+    // torn file are carried over so that later appends stay reachable.
+    auto records = valid ? loaded_.data() + sizeof(FileHeader) : nullptr;
+    auto records_size = valid ? valid - sizeof(FileHeader) : 0;
+    auto fd = Rebuild(path, records, records_size);
+    if (fd >= 0) {
+      // Also drops the lock on the replaced file
+      close(fd_);
+      fd_ = fd;
+    } else if (valid == 0) [[unlikely]] {
+      SET_ERROR("Failed to write %s", path);
+      CloseLocked();
+      return false;
+    } else {
+      read_only_ = true;
+    }
+  }
+  flock(fd_, LOCK_UN);
+  enabled_ = true;
+  return true;
+}
+
+bool RelocationCache::IsEnabled() {
+  return enabled_.load(std::memory_order_relaxed);
+}
+
+bool RelocationCache::Lookup(func_t address, TrampolineType type, RelocatedCode* relocated) {
+  if (!IsEnabled()) return false;
+
+  Key key;
+  if (!GetKey(address, type, &key)) return false;
+
+  CacheLocker locker;
+  auto it = records_.find(key);
+  if (it == records_.end()) {
+    Profiler::CountCacheLookup(false);
+    return false;
+  }
+
+  // The same bytes HookInfo::function_backup captures, anything else means the module was
+  // patched in memory or rebuilt without a new build-id. The fresh entry supersedes this one.
+  auto record = it->second;
+  uint8_t live[kMaxFirstTrampolineSize];
+  if (!Memory::Copy(live, address, record->overwrite_size) ||
+      memcmp(live, record->original, record->overwrite_size) != 0) {
+    records_.erase(it);
+    Profiler::CountCacheLookup(false);
+    return false;
+  }
+
+  memcpy(relocated->code, record + 1, record->code_size);
+  relocated->code_size = record->code_size;
+  auto literals = GetLiterals(record);
+  for (uint16_t i = 0; i < record->literal_count; ++i) {
+    auto value = reinterpret_cast<uint64_t>(address) + literals[i].delta;
+    memcpy(&relocated->code[literals[i].offset], &value, sizeof(value));
+    relocated->literals[i] = static_cast<uint16_t>(literals[i].offset);
+  }
+  relocated->literal_count = static_cast<uint8_t>(record->literal_count);
+  auto loads = GetLoads(record);
+  for (uint16_t i = 0; i < record->load_count; ++i) {
+    relocated->loads[i] = {loads[i].position, loads[i].jump != 0};
+  }
+  relocated->load_count = static_cast<uint8_t>(record->load_count);
+  relocated->overwrite_size = record->overwrite_size;
+  relocated->address = reinterpret_cast<uintptr_t>(address);
+  Profiler::CountCacheLookup(true);
+  return true;
+}
+
+void RelocationCache::Store(func_t address, TrampolineType type, const RelocatedCode& relocated) {
+  if (!IsEnabled()) return;
+  if (relocated.overwrite_size > kMaxFirstTrampolineSize) [[unlikely]] {
+    return;
+  }
+
+  Key key;
+  if (!GetKey(address, type, &key)) return;
+
+  // Built on the stack, only the copy kept in memory below comes from the heap
+  alignas(Record) uint8_t buffer[kMaxRecordSize]{};
+  auto size = GetRecordSize(relocated.code_size, relocated.literal_count, relocated.load_count);
+  auto literals_offset = GetLiteralsOffset(relocated.code_size);
+  auto record = reinterpret_cast<Record*>(buffer);
+  record->size = static_cast<uint32_t>(size);
+  record->module = key.module;
+  record->offset = key.offset;
+  record->type = key.type;
+  record->overwrite_size = static_cast<uint8_t>(relocated.overwrite_size);
+  record->code_size = relocated.code_size;
+  record->literal_count = relocated.literal_count;
+  record->load_count = relocated.load_count;
+  if (!Memory::Copy(record->original, address, relocated.overwrite_size)) [[unlikely]] {
+    return;
+  }
+  memcpy(record + 1, relocated.code, relocated.code_size);
+  auto literals = reinterpret_cast<Literal*>(buffer + literals_offset);
+  for (uint8_t i = 0; i < relocated.literal_count; ++i) {
+    uint64_t value;
+    memcpy(&value, &relocated.code[relocated.literals[i]], sizeof(value));
+    literals[i].offset = relocated.literals[i];
+    literals[i].delta = static_cast<int64_t>(value - reinterpret_cast<uint64_t>(address));
+  }
+  auto loads = reinterpret_cast<Load*>(literals + relocated.literal_count);
+  for (uint8_t i = 0; i < relocated.load_count; ++i) {
+    loads[i] = {relocated.loads[i].position, relocated.loads[i].jump};
+  }
+  record->checksum = Checksum(record);
+
+  CacheLocker locker;
+  if (fd_ < 0) return;
+  if (!read_only_) {
+    FileLocker file_locker(fd_);
+    // Other processes append as well, only the file knows how large it is now
+    struct stat st {};
+    if (fstat(fd_, &st) == 0 && static_cast<size_t>(st.st_size) + size <= kMaxFileSize) {
+      auto written = write(fd_, buffer, size);
+      if (written > 0 && written != static_cast<ssize_t>(size)) [[unlikely]] {
+        // A torn record would hide every later one from readers
+        if (ftruncate(fd_, st.st_size) != 0) read_only_ = true;
+      }
+    }
+  }
+  auto& stored = appended_.emplace_back(buffer, buffer + size);
+  records_[key] = reinterpret_cast<const Record*>(stored.data());
+}
+
+[[gnu::visibility("default"), maybe_unused]] bool SetRelocationCache(const char* path) {
+  if (path) ElfResolver::Refresh();
+  return RelocationCache::Open(path);
+}
+
+}  // namespace rv64hook
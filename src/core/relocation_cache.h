@@ -0,0 +1,42 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "arch/common/instruction_relocator.h"
+#include "rv64hook.h"
+
+namespace rv64hook {
+
+// Relocated prologues kept across runs in an append-only file, keyed by the build-id of the
+// module and the offset of the function. An entry is only used while the original
+// instructions still match it, modules are looked up without entering the loader. Unlike
+// InstructionRelocator::Prepare, Lookup and Store take a mutex and Store allocates the records it
+// keeps in memory.
+class RelocationCache {
+ public:
+  // nullptr closes the cache
+  static bool Open(const char* path);
+
+  [[nodiscard]] static bool IsEnabled();
+
+  static bool Lookup(func_t address, TrampolineType type, RelocatedCode* relocated);
+
+  static void Store(func_t address, TrampolineType type, const RelocatedCode& relocated);
+};
+
+}  // namespace rv64hook
@@ -20,16 +20,21 @@
 #include <unistd.h>
 
 #include <cstring>
-#include <map>
+#include <tuple>
 
+#include "address_index.h"
 #include "arch/common/instruction_relocator.h"
 #include "arch/common/trampoline.h"
 #include "config.h"
+#include "elf/elf_resolver.h"
 #include "function_record.h"
 #include "hook_handle.h"
 #include "hook_locker.h"
+#include "icache.h"
 #include "logger.h"
 #include "memory.h"
+#include "profiler.h"
+#include "relocation_cache.h"
 #include "rv64hook_internal.h"
 
 namespace rv64hook {
@@ -37,16 +42,81 @@ namespace rv64hook {
 static constexpr const char* kTag = "Hook";
 
 static TrampolineAllocator trampoline_allocator_(TrampolineType::kDefault);
-static std::map<func_t, FunctionRecord> function_records_;
+static constinit AddressIndex<FunctionRecord> function_records_;
 
-HookHandle* DoHook(func_t address,
-                   func_t hook,
-                   RegisterHandler pre_handler,
-                   RegisterHandler post_handler,
-                   void* data,
-                   func_t* user_backup_addr) {
-  HookLocker locker;
-  ClearError();
+bool AllocHookTrampoline(PreparedHook* hook) {
+  ScopedPhaseTimer timer(InstallPhase::kAllocSecondTrampoline);
+  std::tie(hook->trampoline, hook->is_user_alloc) =
+      Trampoline::AllocSecondTrampoline(hook->address);
+  return hook->trampoline != nullptr;
+}
+
+bool RelocateHook(PreparedHook* hook) {
+  {
+    ScopedPhaseTimer timer(InstallPhase::kReadTest);
+    if (uint8_t read_test[32]; !Memory::Copy(read_test, hook->address, sizeof(read_test)))
+        [[unlikely]] {
+      SET_ERROR("Function is not readable");
+      return false;
+    }
+  }
+
+  ScopedPhaseTimer timer(InstallPhase::kRelocate);
+  hook->type = Trampoline::GetSuggestedTrampolineType(hook->address, hook->trampoline);
+  if (RelocationCache::Lookup(hook->address, hook->type, &hook->relocated)) {
+    return true;
+  }
+  if (!InstructionRelocator::Prepare(
+          hook->address, Trampoline::GetFirstTrampolineSize(hook->type), &hook->relocated))
+      [[unlikely]] {
+    return false;
+  }
+  RelocationCache::Store(hook->address, hook->type, hook->relocated);
+  return true;
+}
+
+HookInfo* CommitHook(PreparedHook* hook) {
+  void* relocated;
+  {
+    ScopedPhaseTimer timer(InstallPhase::kRelocate);
+    relocated = InstructionRelocator::Install(hook->relocated);
+  }
+  if (!relocated) [[unlikely]] {
+    DiscardHook(hook);
+    return nullptr;
+  }
+
+  HookInfo* info;
+  {
+    ScopedPhaseTimer timer(InstallPhase::kCreateInfo);
+    info = HookInfo::Create(hook->address,
+                            hook->trampoline,
+                            hook->is_user_alloc,
+                            relocated,
+                            hook->relocated.overwrite_size);
+  }
+  if (!info) [[unlikely]] {
+    DiscardHook(hook);
+    Memory::Free(relocated);
+    SET_ERROR("Out of memory");
+    return nullptr;
+  }
+  // Owned by info from now on
+  hook->trampoline = nullptr;
+  return info;
+}
+
+void DiscardHook(PreparedHook* hook) {
+  if (hook->is_user_alloc) {
+    trampoline_allocator_.custom_free(hook->trampoline, trampoline_allocator_.data);
+  } else {
+    Trampoline::FreeSecondTrampoline(hook->trampoline);
+  }
+  hook->trampoline = nullptr;
+}
+
+HookInfo* PrepareHookInfo(func_t address, bool* created, TrampolineType* type) {
+  *created = false;
 
   auto info = HookInfo::Lookup(address);
   if (info) {
@@ -54,33 +124,76 @@ HookHandle* DoHook(func_t address,
       SET_ERROR("Too many hooks");
       return nullptr;
     }
-  } else {
-    if (uint8_t read_test[32]; !Memory::Copy(read_test, address, sizeof(read_test))) [[unlikely]] {
-      SET_ERROR("Function is not readable");
-      return nullptr;
-    }
+    return info;
+  }
 
-    auto [trampoline, is_user_alloc] = Trampoline::AllocSecondTrampoline(address);
-    if (!trampoline) {
-      return nullptr;
-    }
-    auto type = Trampoline::GetSuggestedTrampolineType(address, trampoline);
+  PreparedHook hook{};
+  hook.address = address;
+  if (!AllocHookTrampoline(&hook)) [[unlikely]] {
+    return nullptr;
+  }
+  if (!RelocateHook(&hook)) [[unlikely]] {
+    DiscardHook(&hook);
+    return nullptr;
+  }
+  info = CommitHook(&hook);
+  if (!info) [[unlikely]] {
+    return nullptr;
+  }
+  *type = hook.type;
+  *created = true;
+  return info;
+}
 
-    void* relocated = nullptr;
-    auto overwrite_size = InstructionRelocator::Relocate(
-        address, Trampoline::GetFirstTrampolineSize(type), &relocated);
-    if (overwrite_size == 0) [[unlikely]] {
-      return nullptr;
-    }
+HookHandle* DoHook(func_t address,
+                   func_t hook,
+                   RegisterHandler pre_handler,
+                   RegisterHandler post_handler,
+                   void* data,
+                   func_t* user_backup_addr,
+                   ContextLevel context,
+                   ProbeHandler probe) {
+  HookLocker locker(address);
+  ClearError();
+  ScopedICacheSync icache;
 
-    info = HookInfo::Create(address, trampoline, is_user_alloc, relocated, overwrite_size);
-    if (!Trampoline::WriteFirstTrampoline(address, trampoline, type)) [[unlikely]] {
-      info->Unhook(false);
+  bool created;
+  TrampolineType type;
+  auto info = PrepareHookInfo(address, &created, &type);
+  if (!info) [[unlikely]] {
+    return nullptr;
+  }
+  // Before the function is patched, so the trampoline is complete once it is reached
+  auto handle = info->NewHookHandle(
+      hook, pre_handler, post_handler, data, user_backup_addr, context, probe);
+  if (!handle) [[unlikely]] {
+    return nullptr;
+  }
+  if (created) {
+    {
+      ScopedPhaseTimer timer(InstallPhase::kFlushICache);
+      // The trampolines must be visible before the jump to them is
+      ICache::Sync();
+    }
+    bool written;
+    {
+      ScopedPhaseTimer timer(InstallPhase::kWriteFirstTrampoline);
+      written = Trampoline::WriteFirstTrampoline(address, info->trampoline, type, false);
+    }
+    {
+      ScopedPhaseTimer timer(InstallPhase::kFlushICache);
+      ICache::Invalidate(address, Trampoline::GetFirstTrampolineSize(type));
+      ICache::Sync();
+    }
+    if (!written) [[unlikely]] {
+      handle->UnhookExt(false);
+      if (user_backup_addr) *user_backup_addr = nullptr;
       SET_ERROR("Function is not writable");
       return nullptr;
     }
+    Profiler::CountInstall();
   }
-  return info->NewHookHandle(hook, pre_handler, post_handler, data, user_backup_addr);
+  return handle;
 }
 
 [[gnu::visibility("default"), maybe_unused]] HookHandle* InlineHook(func_t address,
@@ -90,7 +203,7 @@ HookHandle* DoHook(func_t address,
     SET_ERROR("Invalid argument");
     return nullptr;
   }
-  return DoHook(address, hook, nullptr, nullptr, nullptr, backup);
+  return DoHook(address, hook, nullptr, nullptr, nullptr, backup, ContextLevel::kFull, nullptr);
 }
 
 [[gnu::visibility("default"), maybe_unused]] HookHandle* InlineInstrument(
@@ -99,16 +212,101 @@ HookHandle* DoHook(func_t address,
     RegisterHandler post_handler,
     void* data,
     func_t* backup) {
+  return InlineInstrument(address, pre_handler, post_handler, data, backup, ContextLevel::kFull);
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookHandle* InlineInstrument(
+    func_t address,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup,
+    ContextLevel context) {
   if (!address || (!pre_handler && !post_handler)) [[unlikely]] {
     SET_ERROR("Invalid argument");
     return nullptr;
   }
-  if (STORE_RETURN_ADDRESS_BY_TLS &&
-      (address == pthread_getspecific || address == pthread_setspecific)) {
-    SET_ERROR("Unsupported function");
+  if (!USE_VECTOR_EXTENSION && context == ContextLevel::kVector) [[unlikely]] {
+    SET_ERROR("Built without the vector extension");
+    return nullptr;
+  }
+  return DoHook(address, nullptr, pre_handler, post_handler, data, backup, context, nullptr);
+}
+
+// The generic trampoline reaches the probe through HookHandleExt::CallProbe, the specialized
+// code calls it directly. Probes never see the context
+[[gnu::visibility("default"), maybe_unused]] HookHandle* InlineProbe(func_t address,
+                                                                     ProbeHandler probe,
+                                                                     void* data) {
+  if (!address || !probe) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return nullptr;
+  }
+  return DoHook(address,
+                nullptr,
+                HookHandleExt::CallProbe,
+                nullptr,
+                data,
+                nullptr,
+                ContextLevel::kIntegerArguments,
+                probe);
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookHandle* InlineHook(const char* library,
+                                                                    const char* symbol,
+                                                                    func_t hook,
+                                                                    func_t* backup) {
+  if (!symbol || !hook) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return nullptr;
+  }
+  auto address = ElfResolver::FindSymbol(library, symbol);
+  if (!address) [[unlikely]] {
+    SET_ERROR("Symbol %s not found", symbol);
+    return nullptr;
+  }
+  ScopedRWXMemory rwx(address, ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+  if (!rwx.IsValid()) [[unlikely]] {
+    SET_ERROR("Function is not writable");
+    return nullptr;
+  }
+  return DoHook(address, hook, nullptr, nullptr, nullptr, backup, ContextLevel::kFull, nullptr);
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookHandle* InlineInstrument(
+    const char* library,
+    const char* symbol,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup) {
+  return InlineInstrument(
+      library, symbol, pre_handler, post_handler, data, backup, ContextLevel::kFull);
+}
+
+[[gnu::visibility("default"), maybe_unused]] HookHandle* InlineInstrument(
+    const char* library,
+    const char* symbol,
+    RegisterHandler pre_handler,
+    RegisterHandler post_handler,
+    void* data,
+    func_t* backup,
+    ContextLevel context) {
+  if (!symbol) [[unlikely]] {
+    SET_ERROR("Invalid argument");
+    return nullptr;
+  }
+  auto address = ElfResolver::FindSymbol(library, symbol);
+  if (!address) [[unlikely]] {
+    SET_ERROR("Symbol %s not found", symbol);
+    return nullptr;
+  }
+  ScopedRWXMemory rwx(address, ScopedRWXMemory::kRead | ScopedRWXMemory::kExec);
+  if (!rwx.IsValid()) [[unlikely]] {
+    SET_ERROR("Function is not writable");
     return nullptr;
   }
-  return DoHook(address, nullptr, pre_handler, post_handler, data, backup);
+  return InlineInstrument(address, pre_handler, post_handler, data, backup, context);
 }
 
 [[gnu::visibility("default"), maybe_unused]] bool InlineUnhook(func_t address) {
@@ -116,7 +314,7 @@ HookHandle* DoHook(func_t address,
     return false;
   }
 
-  HookLocker locker;
+  HookLocker locker(address);
   ClearError();
 
   if (auto info = HookInfo::Lookup(address); info && info->root_handle) [[likely]] {
@@ -124,9 +322,9 @@ HookHandle* DoHook(func_t address,
     return true;
   }
 
-  if (auto it = function_records_.find(address); it != function_records_.end()) {
-    it->second.Unhook();
-    function_records_.erase(address);
+  if (auto record = function_records_.Erase(address); record) {
+    record->Unhook();
+    delete record;
     return true;
   }
 
@@ -141,24 +339,32 @@ HookHandle* DoHook(func_t address,
     return 0;
   }
 
-  HookLocker locker;
+  HookLocker locker(address);
   ClearError();
 
-  FunctionRecord* record = nullptr;
+  auto record = function_records_.Find(address);
 
-  if (auto it = function_records_.find(address); it != function_records_.end()) {
-    record = &it->second;
+  if (record) {
     if (!record->IsModified()) [[unlikely]] {
       SET_ERROR("Too many hooks");
       return 0;
     }
   } else {
-    record = &function_records_.emplace(address, address).first->second;
+    record = new FunctionRecord(address);
+    if (!function_records_.Insert(address, record)) [[unlikely]] {
+      delete record;
+      SET_ERROR("Out of memory");
+      return 0;
+    }
   }
 
   return record->WriteTrampoline(hook, backup);
 }
 
+[[gnu::visibility("default"), maybe_unused]] bool IsHooked(func_t address) {
+  return HookInfo::Lookup(address) || function_records_.Find(address);
+}
+
 TrampolineAllocator* GetTrampolineAllocator() {
   return &trampoline_allocator_;
 }
@@ -18,10 +18,34 @@
 
 #pragma once
 
+#include "arch/common/instruction_relocator.h"
 #include "rv64hook.h"
 
 namespace rv64hook {
 
+class HookInfo;
+
 TrampolineAllocator* GetTrampolineAllocator();
 
-}
+// State of a function that is about to be hooked for the first time
+struct PreparedHook {
+  func_t address;
+  void* trampoline;
+  bool is_user_alloc;
+  TrampolineType type;
+  RelocatedCode relocated;
+};
+
+HookInfo* PrepareHookInfo(func_t address, bool* created, TrampolineType* type);
+
+bool AllocHookTrampoline(PreparedHook* hook);
+
+// Read test and relocation, the only stage that may run outside the hook locks
+bool RelocateHook(PreparedHook* hook);
+
+// Frees the trampoline on failure
+HookInfo* CommitHook(PreparedHook* hook);
+
+void DiscardHook(PreparedHook* hook);
+
+}  // namespace rv64hook
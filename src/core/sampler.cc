@@ -0,0 +1,41 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sampler.h"
+
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+STATIC_TLS static thread_local uint64_t seed_ = 0;
+
+Sampler::State* Sampler::NewState() {
+  return new State{1, 1, 0};
+}
+
+// Calls may be running the check meanwhile, a countdown they store back only shifts one sample
+void Sampler::SetRate(State* state, uint32_t rate) {
+  __atomic_store_n(&state->rate, rate, __ATOMIC_RELAXED);
+  __atomic_store_n(&state->countdown, rate, __ATOMIC_RELAXED);
+}
+
+bool Sampler::GetThreadPointerOffset(intptr_t* offset) {
+  return rv64hook::GetThreadPointerOffset(&seed_, offset);
+}
+
+}  // namespace rv64hook
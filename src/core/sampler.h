@@ -0,0 +1,46 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace rv64hook {
+
+// State behind the sampling check the trampolines make on entry, with nothing but two
+// temporaries. It is written on every call, so it lives outside the trampoline
+class Sampler {
+ public:
+  // One per sampled function
+  struct State {
+    uint32_t rate;
+    // kEveryNth, calls left until the next sampled one
+    uint32_t countdown;
+    // kRandom where the per-thread seed cannot be reached through tp
+    uint64_t seed;
+  };
+
+  static State* NewState();
+
+  static void SetRate(State* state, uint32_t rate);
+
+  // Offset of this thread's xorshift seed from tp. 0 until the first draw, which seeds it with tp
+  static bool GetThreadPointerOffset(intptr_t* offset);
+};
+
+}  // namespace rv64hook
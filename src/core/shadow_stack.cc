@@ -0,0 +1,92 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shadow_stack.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <cstdlib>
+
+#include "libc/libc.h"
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+STATIC_TLS static thread_local ShadowStack::Block block_{};
+
+static pthread_once_t key_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t key_;
+
+void ShadowStack::Push(void* return_address, uintptr_t sp) {
+  auto& block = block_;
+  if (block.top == block.limit) [[unlikely]] Grow(block);
+  *block.top++ = {return_address, sp};
+}
+
+void* ShadowStack::Pop(uintptr_t sp) {
+  auto& block = block_;
+  auto top = block.top;
+  do {
+    --top;
+  } while (top->sp < sp);
+  // Only the sentinel was left, there is no return address to go back to
+  if (top == block.base) [[unlikely]] abort();
+  // Read before the slot is released, a signal handler may push over it
+  auto return_address = top->return_address;
+  block.top = top;
+  return return_address;
+}
+
+bool ShadowStack::GetThreadPointerOffset(intptr_t* offset) {
+  return rv64hook::GetThreadPointerOffset(&block_, offset);
+}
+
+// Runs with hooks possibly active on this thread, so it only uses raw syscalls and fills in
+// the block before pthread_setspecific, which may itself be hooked
+void ShadowStack::Grow(Block& block) {
+  auto size = static_cast<size_t>(block.limit - block.base);
+  auto capacity = size ? size * 2 : kInitialCapacity;
+  auto base = static_cast<Entry*>(libc_mmap_anonymous(capacity * sizeof(Entry)));
+  // The return address of the current call would be lost
+  if (base == MAP_FAILED) [[unlikely]] abort();
+
+  auto old_base = block.base;
+  if (old_base) {
+    libc_memcpy(base, old_base, size * sizeof(Entry));
+  } else {
+    base[0] = {reinterpret_cast<void*>(&abort), UINTPTR_MAX};
+    size = 1;
+  }
+  block = {base + size, base + capacity, base};
+
+  if (old_base) {
+    libc_munmap(old_base, size * sizeof(Entry));
+  } else {
+    pthread_once(&key_once_, [] { pthread_key_create(&key_, Destroy); });
+    pthread_setspecific(key_, base);
+  }
+}
+
+void ShadowStack::Destroy(void*) {
+  auto& block = block_;
+  libc_munmap(block.base, (block.limit - block.base) * sizeof(Entry));
+  block = {};
+}
+
+}  // namespace rv64hook
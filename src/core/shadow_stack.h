@@ -0,0 +1,67 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rv64hook {
+
+// Return addresses of the hooked calls a thread is in, kept for the post handlers. One stack
+// per thread for the whole library, the trampolines push on entry and pop after the backup
+// returns. Entries are matched by the stack pointer the hooked function was entered with, so
+// frames abandoned by longjmp or an exception are dropped on the next pop. The first entry is a
+// sentinel above every sp, which stops that search at the base. Its return address is abort(),
+// in case the generated code, which does not check for it, ever pops it.
+class ShadowStack {
+ public:
+  struct Entry {
+    void* return_address;
+    uintptr_t sp;
+  };
+
+  // Generated code bumps `top` inline and calls Push once it reaches `limit`
+  struct Block {
+    Entry* top;
+    Entry* limit;
+    Entry* base;
+  };
+
+  static void Push(void* return_address, uintptr_t sp);
+
+  static void* Pop(uintptr_t sp);
+
+  // Offset of this thread's Block from tp, the same for every thread. False if the block is
+  // not in static TLS, the trampolines then call Push and Pop
+  static bool GetThreadPointerOffset(intptr_t* offset);
+
+ private:
+  // Doubled each time the stack fills up
+  static constexpr size_t kInitialCapacity = 256;
+
+  static void Grow(Block& block);
+
+  static void Destroy(void* base);
+};
+
+static_assert(offsetof(ShadowStack::Block, top) == 0, "Bad Block layout");
+static_assert(offsetof(ShadowStack::Block, limit) == 8, "Bad Block layout");
+static_assert(sizeof(ShadowStack::Entry) == 16, "Bad Entry layout");
+
+}  // namespace rv64hook
@@ -0,0 +1,110 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "thread_filter.h"
+
+#include <pthread.h>
+
+#include "thread_pointer.h"
+
+namespace rv64hook {
+
+STATIC_TLS static thread_local ThreadFilter::Block block_{};
+
+static pthread_mutex_t filter_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t key_;
+// Threads that have set a bit and not exited yet
+static ThreadFilter::Block* blocks_ = nullptr;
+static uint64_t used_[ThreadFilter::kWords];
+
+class FilterLocker {
+ public:
+  FilterLocker() {
+    pthread_mutex_lock(&filter_mutex_);
+  }
+
+  ~FilterLocker() {
+    pthread_mutex_unlock(&filter_mutex_);
+  }
+};
+
+int16_t ThreadFilter::AllocIndex() {
+  FilterLocker locker;
+  for (int i = 0; i < kWords; ++i) {
+    if (~used_[i] == 0) continue;
+    auto bit = __builtin_ctzll(~used_[i]);
+    used_[i] |= uint64_t{1} << bit;
+    return static_cast<int16_t>(i * 64 + bit);
+  }
+  return kNone;
+}
+
+void ThreadFilter::FreeIndex(int16_t index) {
+  FilterLocker locker;
+  auto word = index / 64;
+  auto mask = ~(uint64_t{1} << (index % 64));
+  used_[word] &= mask;
+  // Other threads may set their own bits in the same words meanwhile
+  for (auto block = blocks_; block; block = block->next) {
+    __atomic_fetch_and(&block->enabled[word], mask, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&block->disabled[word], mask, __ATOMIC_RELAXED);
+  }
+}
+
+void ThreadFilter::SetEnabledForCurrentThread(int16_t index, bool enabled) {
+  auto& block = block_;
+  if (!block.registered) {
+    FilterLocker locker;
+    block.next = blocks_;
+    if (blocks_) blocks_->previous = &block;
+    blocks_ = &block;
+    block.registered = true;
+    pthread_once(&key_once_, [] { pthread_key_create(&key_, Unregister); });
+    pthread_setspecific(key_, &block);
+  }
+
+  auto word = index / 64;
+  auto bit = uint64_t{1} << (index % 64);
+  __atomic_fetch_or(&(enabled ? block.enabled : block.disabled)[word], bit, __ATOMIC_RELAXED);
+  __atomic_fetch_and(&(enabled ? block.disabled : block.enabled)[word], ~bit, __ATOMIC_RELAXED);
+}
+
+bool ThreadFilter::IsEnabled(int16_t index, bool enabled_by_default) {
+  auto& block = block_;
+  auto bit = uint64_t{1} << (index % 64);
+  if (enabled_by_default) {
+    return (__atomic_load_n(&block.disabled[index / 64], __ATOMIC_RELAXED) & bit) == 0;
+  }
+  return (__atomic_load_n(&block.enabled[index / 64], __ATOMIC_RELAXED) & bit) != 0;
+}
+
+bool ThreadFilter::GetThreadPointerOffset(intptr_t* offset) {
+  return rv64hook::GetThreadPointerOffset(&block_, offset);
+}
+
+void ThreadFilter::Unregister(void* arg) {
+  auto& block = *static_cast<Block*>(arg);
+  FilterLocker locker;
+  if (block.previous) block.previous->next = block.next;
+  else blocks_ = block.next;
+  if (block.next) block.next->previous = block.previous;
+  block = {};
+}
+
+}  // namespace rv64hook
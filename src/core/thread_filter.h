@@ -0,0 +1,64 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rv64hook {
+
+// Per-thread enablement of hooked functions. A function that uses it owns an index into two
+// bitmaps every thread has: the threads that enabled it and the threads that disabled it. The
+// trampoline tests the bit that matters for the function's default with one tp-relative load.
+class ThreadFilter {
+ public:
+  static constexpr int16_t kNone = -1;
+  static constexpr int kMaxFunctions = 256;
+  static constexpr int kWords = kMaxFunctions / 64;
+
+  struct Block {
+    uint64_t enabled[kWords];
+    uint64_t disabled[kWords];
+    Block* previous;
+    Block* next;
+    bool registered;
+  };
+
+  // kNone once kMaxFunctions functions use it
+  static int16_t AllocIndex();
+
+  // Forgets the choices of every thread
+  static void FreeIndex(int16_t index);
+
+  static void SetEnabledForCurrentThread(int16_t index, bool enabled);
+
+  // Called by trampolines where the block is not in static TLS
+  static bool IsEnabled(int16_t index, bool enabled_by_default);
+
+  static bool GetThreadPointerOffset(intptr_t* offset);
+
+ private:
+  static void Unregister(void* arg);
+};
+
+static_assert(offsetof(ThreadFilter::Block, enabled) == 0, "Bad Block layout");
+static_assert(offsetof(ThreadFilter::Block, disabled) == 8 * ThreadFilter::kWords,
+              "Bad Block layout");
+
+}  // namespace rv64hook
@@ -0,0 +1,46 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Thread-locals the trampolines reach at a fixed offset from tp. Bionic refuses initial-exec TLS
+// in libraries loaded by dlopen, so there they are only reached through calls
+#ifdef __ANDROID__
+#define STATIC_TLS
+#else
+#define STATIC_TLS [[gnu::tls_model("initial-exec")]]
+#endif
+
+namespace rv64hook {
+
+// Offset of a STATIC_TLS variable of the calling thread from tp, the same for every thread
+static inline bool GetThreadPointerOffset([[maybe_unused]] const void* tls,
+                                          [[maybe_unused]] intptr_t* offset) {
+#if defined(__riscv) && !defined(__ANDROID__)
+  uintptr_t tp;
+  asm("mv %0, tp" : "=r"(tp));
+  *offset = static_cast<intptr_t>(reinterpret_cast<uintptr_t>(tls) - tp);
+  return true;
+#else
+  return false;
+#endif
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,256 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "elf_module.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace rv64hook {
+
+static uint32_t GnuHash(const char* name) {
+  uint32_t h = 5381;
+  for (auto p = reinterpret_cast<const uint8_t*>(name); *p; ++p) {
+    h = h * 33 + *p;
+  }
+  return h;
+}
+
+static uint32_t SysvHash(const char* name) {
+  uint32_t h = 0;
+  for (auto p = reinterpret_cast<const uint8_t*>(name); *p; ++p) {
+    h = (h << 4) + *p;
+    auto g = h & 0xf0000000;
+    h ^= g >> 24;
+    h &= ~g;
+  }
+  return h;
+}
+
+ElfModule::ElfModule(const dl_phdr_info* info)
+    : generation(0), base_(info->dlpi_addr), name_(info->dlpi_name ? info->dlpi_name : "") {
+  const ElfW(Dyn)* dynamic = nullptr;
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    auto phdr = &info->dlpi_phdr[i];
+    switch (phdr->p_type) {
+      case PT_LOAD:
+        segments_.emplace_back(base_ + phdr->p_vaddr, base_ + phdr->p_vaddr + phdr->p_memsz);
+        break;
+      case PT_DYNAMIC:
+        dynamic = reinterpret_cast<const ElfW(Dyn)*>(base_ + phdr->p_vaddr);
+        break;
+      case PT_NOTE:
+        if (build_id_.empty()) LoadBuildId(phdr);
+        break;
+      default:
+        break;
+    }
+  }
+  if (!dynamic) return;
+
+  for (auto dyn = dynamic; dyn->d_tag != DT_NULL; ++dyn) {
+    switch (dyn->d_tag) {
+      case DT_SYMTAB:
+        dynsym_ = reinterpret_cast<const ElfW(Sym)*>(ToAddress(dyn->d_un.d_ptr));
+        break;
+      case DT_STRTAB:
+        dynstr_ = reinterpret_cast<const char*>(ToAddress(dyn->d_un.d_ptr));
+        break;
+      case DT_VERSYM:
+        versym_ = reinterpret_cast<const ElfW(Half)*>(ToAddress(dyn->d_un.d_ptr));
+        break;
+      case DT_GNU_HASH:
+        gnu_hash_ = reinterpret_cast<const uint32_t*>(ToAddress(dyn->d_un.d_ptr));
+        break;
+      case DT_HASH:
+        sysv_hash_ = reinterpret_cast<const uint32_t*>(ToAddress(dyn->d_un.d_ptr));
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+ElfModule::~ElfModule() {
+  if (file_) munmap(file_, file_size_);
+}
+
+void* ElfModule::FindSymbol(const char* name, bool* indirect) {
+  const ElfW(Sym)* sym = nullptr;
+  if (dynsym_ && dynstr_) {
+    if (gnu_hash_) {
+      sym = FindGnuHashSymbol(name);
+    } else if (sysv_hash_) {
+      sym = FindSysvHashSymbol(name);
+    }
+  }
+  if (!sym) {
+    if (!symtab_loaded_) LoadSymtab();
+    if (auto it = symtab_.find(name); it != symtab_.end()) {
+      sym = it->second;
+    }
+  }
+  if (!sym) return nullptr;
+
+  *indirect = ELF64_ST_TYPE(sym->st_info) == STT_GNU_IFUNC;
+  return reinterpret_cast<void*>(base_ + sym->st_value);
+}
+
+bool ElfModule::Contains(uintptr_t address) const {
+  for (auto [begin, end] : segments_) {
+    if (address >= begin && address < end) return true;
+  }
+  return false;
+}
+
+void ElfModule::LoadBuildId(const ElfW(Phdr)* note) {
+  auto p = base_ + note->p_vaddr;
+  auto end = p + note->p_memsz;
+  while (p + sizeof(ElfW(Nhdr)) <= end) {
+    auto nhdr = reinterpret_cast<const ElfW(Nhdr)*>(p);
+    auto name = p + sizeof(ElfW(Nhdr));
+    auto desc = name + __builtin_align_up(nhdr->n_namesz, 4);
+    p = desc + __builtin_align_up(nhdr->n_descsz, 4);
+    if (p > end) break;
+    if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+        memcmp(reinterpret_cast<const void*>(name), "GNU", 4) == 0) {
+      build_id_.assign(reinterpret_cast<const char*>(desc), nhdr->n_descsz);
+      return;
+    }
+  }
+}
+
+// The dynamic section is relocated in place by glibc on most targets, but not by bionic
+// nor by glibc on riscv
+uintptr_t ElfModule::ToAddress(ElfW(Addr) ptr) const {
+  return ptr < base_ ? base_ + ptr : ptr;
+}
+
+bool ElfModule::IsDefined(const ElfW(Sym)* sym) const {
+  if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0) return false;
+  auto type = ELF64_ST_TYPE(sym->st_info);
+  return type == STT_FUNC || type == STT_GNU_IFUNC || type == STT_OBJECT || type == STT_NOTYPE;
+}
+
+const ElfW(Sym)* ElfModule::FindGnuHashSymbol(const char* name) const {
+  constexpr uint32_t kBloomBits = sizeof(ElfW(Addr)) * 8;
+
+  auto bucket_count = gnu_hash_[0];
+  auto symbol_offset = gnu_hash_[1];
+  auto bloom_size = gnu_hash_[2];
+  auto bloom_shift = gnu_hash_[3];
+  auto bloom = reinterpret_cast<const ElfW(Addr)*>(gnu_hash_ + 4);
+  auto buckets = reinterpret_cast<const uint32_t*>(bloom + bloom_size);
+  auto chain = buckets + bucket_count;
+
+  auto hash = GnuHash(name);
+  auto word = bloom[(hash / kBloomBits) % bloom_size];
+  auto mask = (ElfW(Addr){1} << (hash % kBloomBits)) |
+              (ElfW(Addr){1} << ((hash >> bloom_shift) % kBloomBits));
+  if ((word & mask) != mask) return nullptr;
+
+  auto index = buckets[hash % bucket_count];
+  if (index < symbol_offset) return nullptr;
+
+  // Prefer the default version, fall back to a hidden one
+  const ElfW(Sym)* hidden = nullptr;
+  for (;; ++index) {
+    auto chain_hash = chain[index - symbol_offset];
+    if ((hash | 1) == (chain_hash | 1)) {
+      auto sym = &dynsym_[index];
+      if (IsDefined(sym) && strcmp(name, dynstr_ + sym->st_name) == 0) {
+        if (!versym_ || !(versym_[index] & 0x8000)) return sym;
+        if (!hidden) hidden = sym;
+      }
+    }
+    if (chain_hash & 1) break;
+  }
+  return hidden;
+}
+
+const ElfW(Sym)* ElfModule::FindSysvHashSymbol(const char* name) const {
+  auto bucket_count = sysv_hash_[0];
+  auto buckets = sysv_hash_ + 2;
+  auto chain = buckets + bucket_count;
+
+  const ElfW(Sym)* hidden = nullptr;
+  for (auto index = buckets[SysvHash(name) % bucket_count]; index != STN_UNDEF;
+       index = chain[index]) {
+    auto sym = &dynsym_[index];
+    if (IsDefined(sym) && strcmp(name, dynstr_ + sym->st_name) == 0) {
+      if (!versym_ || !(versym_[index] & 0x8000)) return sym;
+      if (!hidden) hidden = sym;
+    }
+  }
+  return hidden;
+}
+
+void ElfModule::LoadSymtab() {
+  symtab_loaded_ = true;
+
+  // Libraries loaded straight from an apk have no file of their own
+  auto path = name_.empty() ? "/proc/self/exe" : name_.c_str();
+  auto fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return;
+  }
+  auto size = static_cast<size_t>(st.st_size);
+  auto file = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) return;
+  file_ = file;
+  file_size_ = size;
+
+  auto data = static_cast<const uint8_t*>(file);
+  auto ehdr = static_cast<const ElfW(Ehdr)*>(file);
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > size) {
+    return;
+  }
+
+  auto shdrs = reinterpret_cast<const ElfW(Shdr)*>(data + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; ++i) {
+    auto& symtab = shdrs[i];
+    if (symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= ehdr->e_shnum) continue;
+    auto& strtab = shdrs[symtab.sh_link];
+    if (symtab.sh_offset + symtab.sh_size > size || strtab.sh_offset + strtab.sh_size > size) {
+      continue;
+    }
+
+    auto syms = reinterpret_cast<const ElfW(Sym)*>(data + symtab.sh_offset);
+    auto strs = reinterpret_cast<const char*>(data + strtab.sh_offset);
+    auto count = symtab.sh_size / sizeof(ElfW(Sym));
+    symtab_.reserve(count);
+    for (size_t j = 0; j < count; ++j) {
+      auto& sym = syms[j];
+      if (!IsDefined(&sym) || sym.st_name == 0 || sym.st_name >= strtab.sh_size) continue;
+      auto name = strs + sym.st_name;
+      symtab_.emplace(std::string_view(name, strnlen(name, strtab.sh_size - sym.st_name)), &sym);
+    }
+  }
+}
+
+}  // namespace rv64hook
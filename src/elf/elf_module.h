@@ -0,0 +1,92 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <link.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rv64hook {
+
+class ElfModule {
+ public:
+  explicit ElfModule(const dl_phdr_info* info);
+
+  ~ElfModule();
+
+  ElfModule(const ElfModule&) = delete;
+
+  ElfModule& operator=(const ElfModule&) = delete;
+
+  [[nodiscard]] uintptr_t GetBase() const {
+    return base_;
+  }
+
+  [[nodiscard]] const std::string& GetName() const {
+    return name_;
+  }
+
+  // Raw NT_GNU_BUILD_ID descriptor, empty if the module has none
+  [[nodiscard]] const std::string& GetBuildId() const {
+    return build_id_;
+  }
+
+  [[nodiscard]] bool Contains(uintptr_t address) const;
+
+  // Looks in .dynsym through the hash tables first, then in .symtab of the file on disk.
+  // For STT_GNU_IFUNC symbols the resolver is returned and `indirect` is set
+  [[nodiscard]] void* FindSymbol(const char* name, bool* indirect);
+
+  uint64_t generation;
+
+ private:
+  uintptr_t base_;
+  std::string name_;
+  std::string build_id_;
+  std::vector<std::pair<uintptr_t, uintptr_t>> segments_;
+
+  const ElfW(Sym)* dynsym_{};
+  const char* dynstr_{};
+  const ElfW(Half)* versym_{};
+  const uint32_t* gnu_hash_{};
+  const uint32_t* sysv_hash_{};
+
+  bool symtab_loaded_{};
+  void* file_{};
+  size_t file_size_{};
+  std::unordered_map<std::string_view, const ElfW(Sym)*> symtab_;
+
+  [[nodiscard]] uintptr_t ToAddress(ElfW(Addr) ptr) const;
+
+  [[nodiscard]] bool IsDefined(const ElfW(Sym)* sym) const;
+
+  [[nodiscard]] const ElfW(Sym)* FindGnuHashSymbol(const char* name) const;
+
+  [[nodiscard]] const ElfW(Sym)* FindSysvHashSymbol(const char* name) const;
+
+  void LoadBuildId(const ElfW(Phdr)* note);
+
+  void LoadSymtab();
+};
+
+}  // namespace rv64hook
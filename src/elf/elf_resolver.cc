@@ -0,0 +1,179 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "elf_resolver.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+namespace rv64hook {
+
+// Lock order is loader lock, then modules_mutex_. Nothing may call into the loader while
+// holding modules_mutex_.
+static pthread_mutex_t modules_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ElfModule*> modules_;
+static uint64_t generation_ = 0;
+static unsigned long long loaded_adds_ = 0;
+static unsigned long long loaded_subs_ = 0;
+
+class ModulesLocker {
+ public:
+  ModulesLocker() {
+    pthread_mutex_lock(&modules_mutex_);
+  }
+
+  ~ModulesLocker() {
+    pthread_mutex_unlock(&modules_mutex_);
+  }
+};
+
+// Let the loader run the IFUNC resolver, it knows the arguments it expects
+static void* ResolveIndirect(const char* path, const char* symbol) {
+  auto handle = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+  if (!handle) return nullptr;
+  auto address = dlsym(handle, symbol);
+  dlclose(handle);
+  return address;
+}
+
+void* ElfResolver::FindSymbol(const char* library, const char* symbol) {
+  Refresh();
+
+  std::string path;
+  {
+    ModulesLocker locker;
+    for (auto module : modules_) {
+      if (library && !MatchesLibrary(module->GetName().c_str(), library)) continue;
+      bool indirect;
+      if (auto address = module->FindSymbol(symbol, &indirect); address) {
+        if (!indirect) return address;
+        path = module->GetName();
+        break;
+      }
+      if (library) break;
+    }
+  }
+  if (path.empty()) return nullptr;
+  return ResolveIndirect(path.c_str(), symbol);
+}
+
+void* ElfResolver::FindSymbol(uintptr_t base, const char* path, const char* symbol) {
+  {
+    ModulesLocker locker;
+    auto it = std::find_if(modules_.begin(), modules_.end(), [&](ElfModule* module) {
+      return module->GetBase() == base && module->GetName() == path;
+    });
+    if (it == modules_.end()) return nullptr;
+    bool indirect;
+    auto address = (*it)->FindSymbol(symbol, &indirect);
+    if (!address || !indirect) return address;
+  }
+  return ResolveIndirect(path, symbol);
+}
+
+bool ElfResolver::FindModule(const void* address,
+                             uint8_t (&build_id)[kMaxBuildIdSize],
+                             size_t* build_id_size,
+                             uintptr_t* base) {
+  ModulesLocker locker;
+  for (auto module : modules_) {
+    if (!module->Contains(reinterpret_cast<uintptr_t>(address))) continue;
+    auto& id = module->GetBuildId();
+    if (id.size() > kMaxBuildIdSize) return false;
+    memcpy(build_id, id.data(), id.size());
+    *build_id_size = id.size();
+    *base = module->GetBase();
+    return true;
+  }
+  return false;
+}
+
+bool ElfResolver::MatchesLibrary(const char* path, const char* library) {
+  if (strchr(library, '/')) {
+    return strcmp(path, library) == 0;
+  }
+  auto slash = strrchr(path, '/');
+  return strcmp(slash ? slash + 1 : path, library) == 0;
+}
+
+// dl_iterate_phdr runs under the loader lock, so iterations never overlap and the generation
+// taken by the first callback orders them
+void ElfResolver::Refresh() {
+  struct Context {
+    uint64_t generation;
+    bool stopped;
+  } context{0, false};
+
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t size, void* data) -> int {
+        auto context = static_cast<Context*>(data);
+        ModulesLocker locker;
+
+        if (context->generation == 0) {
+          if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+            if (info->dlpi_adds == loaded_adds_ && info->dlpi_subs == loaded_subs_) {
+              context->stopped = true;
+              return 1;
+            }
+            loaded_adds_ = info->dlpi_adds;
+            loaded_subs_ = info->dlpi_subs;
+          }
+          context->generation = ++generation_;
+        }
+
+        auto name = info->dlpi_name ? info->dlpi_name : "";
+        auto it = std::find_if(modules_.begin(), modules_.end(), [&](ElfModule* module) {
+          return module->GetBase() == info->dlpi_addr && module->GetName() == name;
+        });
+        if (it != modules_.end()) {
+          (*it)->generation = context->generation;
+        } else {
+          auto module = new ElfModule(info);
+          module->generation = context->generation;
+          modules_.push_back(module);
+        }
+        return 0;
+      },
+      &context);
+
+  if (context.stopped || context.generation == 0) return;
+
+  ModulesLocker locker;
+  // A newer iteration has already seen everything this one did
+  if (context.generation != generation_) return;
+  std::erase_if(modules_, [&](ElfModule* module) {
+    if (module->generation == context.generation) return false;
+    delete module;
+    return true;
+  });
+}
+
+[[gnu::visibility("default"), maybe_unused]] void* FindSymbol(const char* library,
+                                                              const char* symbol) {
+  if (!symbol) [[unlikely]] {
+    return nullptr;
+  }
+  return ElfResolver::FindSymbol(library, symbol);
+}
+
+}  // namespace rv64hook
@@ -0,0 +1,51 @@
+/**
+ * This file is part of riscv64-inline-hook.
+ *
+ * riscv64-inline-hook is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * riscv64-inline-hook is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with riscv64-inline-hook.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "elf_module.h"
+
+namespace rv64hook {
+
+// Caches parsed modules of this process, keyed by load address and path
+class ElfResolver {
+ public:
+  // `library` is a file name or full path, nullptr searches every module in load order
+  static void* FindSymbol(const char* library, const char* symbol);
+
+  // Only looks at cached modules, call Refresh() beforehand. IFUNC symbols are resolved by the
+  // loader like above, so no lock the loader may wait for must be held
+  static void* FindSymbol(uintptr_t base, const char* path, const char* symbol);
+
+  static constexpr size_t kMaxBuildIdSize = 64;
+
+  // Only looks at cached modules and never enters the loader, call Refresh() beforehand. Does
+  // not allocate, modules with a longer build-id are not found
+  static bool FindModule(const void* address,
+                         uint8_t (&build_id)[kMaxBuildIdSize],
+                         size_t* build_id_size,
+                         uintptr_t* base);
+
+  static bool MatchesLibrary(const char* path, const char* library);
+
+  static void Refresh();
+};
+
+}  // namespace rv64hook
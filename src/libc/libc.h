@@ -19,7 +19,10 @@
 #pragma once
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <cerrno>
 #include <cstdint>
 
 #include "config.h"
@@ -36,6 +39,24 @@ static inline void libc_mprotect(const void* addr, size_t size, int prot) {
   mprotect(addr, size, prot);
 }
 
+static inline void libc_flush_icache(const void* begin, const void* end) {
+  __builtin___clear_cache(static_cast<char*>(const_cast<void*>(begin)),
+                          static_cast<char*>(const_cast<void*>(end)));
+}
+
+static inline long libc_membarrier(int cmd, unsigned int flags) {
+  auto r = syscall(__NR_membarrier, cmd, flags, 0);
+  return r < 0 ? -errno : r;
+}
+
+static inline void* libc_mmap_anonymous(size_t size) {
+  return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+static inline void libc_munmap(void* addr, size_t size) {
+  munmap(addr, size);
+}
+
 #else
 
 extern "C" {
@@ -54,6 +75,18 @@ static inline void libc_memcpy(void* dest, const void* src, size_t count) {
 
 void libc_mprotect(const void* addr, size_t size, int prot);
 
+// Makes [begin, end) visible to instruction fetch on every hart of this process
+void libc_flush_icache(const void* begin, const void* end);
+
+// Returns a negative errno on failure
+long libc_membarrier(int cmd, unsigned int flags);
+
+// Private read-write pages. Returns MAP_FAILED on failure, without going through mmap, which
+// may be hooked
+void* libc_mmap_anonymous(size_t size);
+
+void libc_munmap(void* addr, size_t size);
+
 #endif
 
 }  // namespace rv64hook
@@ -18,6 +18,9 @@
 
 #include <sys/mman.h>
 #include <syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
 
 #include "libc.h"
 
@@ -25,6 +28,10 @@ namespace rv64hook {
 
 #if defined(__riscv)
 
+#ifndef __NR_riscv_flush_icache
+#define __NR_riscv_flush_icache 259  // __NR_arch_specific_syscall + 15
+#endif
+
 void libc_mprotect(const void* addr, size_t size, int prot) {
   register int nr asm("a7") = __NR_mprotect;
   register auto arg0 asm("a0") = addr;
@@ -33,6 +40,45 @@ void libc_mprotect(const void* addr, size_t size, int prot) {
   asm volatile("ecall" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2));
 }
 
+void libc_flush_icache(const void* begin, const void* end) {
+  register int nr asm("a7") = __NR_riscv_flush_icache;
+  register auto arg0 asm("a0") = begin;
+  register auto arg1 asm("a1") = end;
+  register long arg2 asm("a2") = 0;  // every thread, not only the calling one
+  asm volatile("ecall" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2) : "memory");
+}
+
+long libc_membarrier(int cmd, unsigned int flags) {
+  register int nr asm("a7") = __NR_membarrier;
+  register long arg0 asm("a0") = cmd;
+  register auto arg1 asm("a1") = flags;
+  register long arg2 asm("a2") = 0;
+  asm volatile("ecall" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2) : "memory");
+  return arg0;
+}
+
+void* libc_mmap_anonymous(size_t size) {
+  register int nr asm("a7") = __NR_mmap;
+  register long arg0 asm("a0") = 0;
+  register auto arg1 asm("a1") = size;
+  register long arg2 asm("a2") = PROT_READ | PROT_WRITE;
+  register long arg3 asm("a3") = MAP_PRIVATE | MAP_ANONYMOUS;
+  register long arg4 asm("a4") = -1;
+  register long arg5 asm("a5") = 0;
+  asm volatile("ecall"
+               : "=r"(arg0)
+               : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2), "r"(arg3), "r"(arg4), "r"(arg5)
+               : "memory");
+  return static_cast<unsigned long>(arg0) > -4096UL ? MAP_FAILED : reinterpret_cast<void*>(arg0);
+}
+
+void libc_munmap(void* addr, size_t size) {
+  register int nr asm("a7") = __NR_munmap;
+  register auto arg0 asm("a0") = addr;
+  register auto arg1 asm("a1") = size;
+  asm volatile("ecall" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1) : "memory");
+}
+
 #elif defined(__aarch64__)
 
 void libc_mprotect(const void* addr, size_t size, int prot) {
@@ -43,12 +89,67 @@ void libc_mprotect(const void* addr, size_t size, int prot) {
   asm volatile("svc #0" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2));
 }
 
+void libc_flush_icache(const void* begin, const void* end) {
+  // Cache maintenance instructions are available to user space
+  __builtin___clear_cache(static_cast<char*>(const_cast<void*>(begin)),
+                          static_cast<char*>(const_cast<void*>(end)));
+}
+
+long libc_membarrier(int cmd, unsigned int flags) {
+  register int nr asm("w8") = __NR_membarrier;
+  register long arg0 asm("x0") = cmd;
+  register auto arg1 asm("x1") = flags;
+  register long arg2 asm("x2") = 0;
+  asm volatile("svc #0" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2) : "memory");
+  return arg0;
+}
+
+void* libc_mmap_anonymous(size_t size) {
+  register int nr asm("w8") = __NR_mmap;
+  register long arg0 asm("x0") = 0;
+  register auto arg1 asm("x1") = size;
+  register long arg2 asm("x2") = PROT_READ | PROT_WRITE;
+  register long arg3 asm("x3") = MAP_PRIVATE | MAP_ANONYMOUS;
+  register long arg4 asm("x4") = -1;
+  register long arg5 asm("x5") = 0;
+  asm volatile("svc #0"
+               : "=r"(arg0)
+               : "r"(nr), "r"(arg0), "r"(arg1), "r"(arg2), "r"(arg3), "r"(arg4), "r"(arg5)
+               : "memory");
+  return static_cast<unsigned long>(arg0) > -4096UL ? MAP_FAILED : reinterpret_cast<void*>(arg0);
+}
+
+void libc_munmap(void* addr, size_t size) {
+  register int nr asm("w8") = __NR_munmap;
+  register auto arg0 asm("x0") = addr;
+  register auto arg1 asm("x1") = size;
+  asm volatile("svc #0" : "=r"(arg0) : "r"(nr), "r"(arg0), "r"(arg1) : "memory");
+}
+
 #else
 
 void libc_mprotect(const void* addr, size_t size, int prot) {
   mprotect(const_cast<void*>(addr), size, prot);
 }
 
+void libc_flush_icache(const void* begin, const void* end) {
+  __builtin___clear_cache(static_cast<char*>(const_cast<void*>(begin)),
+                          static_cast<char*>(const_cast<void*>(end)));
+}
+
+long libc_membarrier(int cmd, unsigned int flags) {
+  auto r = syscall(__NR_membarrier, cmd, flags, 0);
+  return r < 0 ? -errno : r;
+}
+
+void* libc_mmap_anonymous(size_t size) {
+  return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+void libc_munmap(void* addr, size_t size) {
+  munmap(addr, size);
+}
+
 #endif
 
 }  // namespace rv64hook